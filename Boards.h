@@ -22,6 +22,13 @@
 
 #include <Arduino.h>
 
+#define MUX_SERIAL_TRANSPORT            1                       // 1 = Firmata talks through MuxSerial (Uart), 0 = through the core's HardwareSerial (Serial)
+#define MUX_KEYPAD                      0                       // 1 = key matrix scanner compiled in (MuxKeypad, rows on port 6, columns on ports 2-5)
+#define MUX_KEYPAD_ROWS                 8                       // rows wired to port 6 (1-16), the key state takes 6 bytes per row and column port
+#define MUX_KEYPAD_COL_PORTS            1                       // column ports from port 2 (1-4), 16 columns each: 8 x 16 keys take 48 bytes
+                                                                // the full 16 x 64 matrix takes 384 bytes: on a 2 KB part the 336 above the default
+                                                                // must come off SEQ_MAX_STEPS, RULE_MAX and the MuxSerial rings first
+
 #define TOTAL_PORTS                     12                      // firmata ports are groups of 8 pins (1 byte for each firmata port = 1 bit per pin)
 #define TOTAL_ANALOG_PINS               16                      // 16 is maximum analogue inputs firmata can cope with atm
 #define TOTAL_PINS                      96                      // 2 muxshields * 3 ports per shield * 16 pins per port = 96
@@ -43,6 +50,9 @@
 #define PIN_TO_MUX_PORT_5(p)            ((p) - MUX_PORT_5)
 #define PIN_TO_MUX_PORT_6(p)            ((p) - MUX_PORT_6)
 
+#define PIN_TO_MUX(p)                   ((p) / MUX_PORT_PINS + 1)   // return mux port # (1-6) of pin#
+#define PIN_TO_MUX_CHANNEL(p)           ((p) % MUX_PORT_PINS)       // return channel # (0-15) of pin# on its mux port
+
 #define PIN_TO_ANALOG(p)                (p)                     // return pin# of analogue pin
 #define PIN_TO_DIGITAL(p)               (p)                     // return pin# of digital pin                                        
 
@@ -66,6 +76,19 @@
 #define IS_PIN_DIGITAL_MUX_OUT5(p)      MUX_PORT_DISABLED
 #define IS_PIN_DIGITAL_MUX_OUT6(p)      ((p) >= MUX_PORT_6 && (p) < MUX_PORT_6 + MUX_PORT_PINS)
 
+                                        // mask of mux ports in digital_out mode (bit 0 = port 1) and number of them
+#define MUX_OUT_PORT_MASK               ((IS_PIN_DIGITAL_MUX_OUT1(MUX_PORT_1) ? 0x01 : 0) | (IS_PIN_DIGITAL_MUX_OUT2(MUX_PORT_2) ? 0x02 : 0) | \
+                                         (IS_PIN_DIGITAL_MUX_OUT3(MUX_PORT_3) ? 0x04 : 0) | (IS_PIN_DIGITAL_MUX_OUT4(MUX_PORT_4) ? 0x08 : 0) | \
+                                         (IS_PIN_DIGITAL_MUX_OUT5(MUX_PORT_5) ? 0x10 : 0) | (IS_PIN_DIGITAL_MUX_OUT6(MUX_PORT_6) ? 0x20 : 0))
+#define TOTAL_MUX_OUT_PORTS             ((IS_PIN_DIGITAL_MUX_OUT1(MUX_PORT_1) ? 1 : 0) + (IS_PIN_DIGITAL_MUX_OUT2(MUX_PORT_2) ? 1 : 0) + \
+                                         (IS_PIN_DIGITAL_MUX_OUT3(MUX_PORT_3) ? 1 : 0) + (IS_PIN_DIGITAL_MUX_OUT4(MUX_PORT_4) ? 1 : 0) + \
+                                         (IS_PIN_DIGITAL_MUX_OUT5(MUX_PORT_5) ? 1 : 0) + (IS_PIN_DIGITAL_MUX_OUT6(MUX_PORT_6) ? 1 : 0))
+
+                                        // mask of mux ports in digital_in modes (bit 0 = port 1)
+#define MUX_IN_PORT_MASK                ((IS_PIN_DIGITAL_MUX_IN1(MUX_PORT_1) ? 0x01 : 0) | (IS_PIN_DIGITAL_MUX_IN2(MUX_PORT_2) ? 0x02 : 0) | \
+                                         (IS_PIN_DIGITAL_MUX_IN3(MUX_PORT_3) ? 0x04 : 0) | (IS_PIN_DIGITAL_MUX_IN4(MUX_PORT_4) ? 0x08 : 0) | \
+                                         (IS_PIN_DIGITAL_MUX_IN5(MUX_PORT_5) ? 0x10 : 0) | (IS_PIN_DIGITAL_MUX_IN6(MUX_PORT_6) ? 0x20 : 0))
+
                                         // check if pin# is in digital_in (no pullup) mode
 #define IS_PIN_DIGITAL_IN(p)            MUX_PORT_DISABLED                                           
 
@@ -75,4 +98,17 @@
                                         // check if pin# is in digital_out mode
 #define IS_PIN_DIGITAL_OUT(p)           (IS_PIN_DIGITAL_MUX_OUT1(p) || IS_PIN_DIGITAL_MUX_OUT2(p) || IS_PIN_DIGITAL_MUX_OUT3(p) || IS_PIN_DIGITAL_MUX_OUT4(p) || IS_PIN_DIGITAL_MUX_OUT5(p) || IS_PIN_DIGITAL_MUX_OUT6(p))
 
+                                        // check if pin# can be dimmed by software PWM (any digital_out pin)
+#define IS_PIN_PWM(p)                   IS_PIN_DIGITAL_OUT(p)
+#define PIN_TO_PWM(p)                   PIN_TO_MUX_CHANNEL(p)
+
+                                        // pins whose firmata state needs more than 1 bit (analogue value, PWM duty)
+#define MUX_PORTS_BELOW(m, mask)        ((((mask) & ((1 << ((m)-1)) - 1)) & 0x01 ? 1 : 0) + (((mask) & ((1 << ((m)-1)) - 1)) & 0x02 ? 1 : 0) + \
+                                         (((mask) & ((1 << ((m)-1)) - 1)) & 0x04 ? 1 : 0) + (((mask) & ((1 << ((m)-1)) - 1)) & 0x08 ? 1 : 0) + \
+                                         (((mask) & ((1 << ((m)-1)) - 1)) & 0x10 ? 1 : 0))
+#define TOTAL_WIDE_PINS                 (TOTAL_ANALOG_PINS + TOTAL_MUX_OUT_PORTS * MUX_PORT_PINS)
+#define IS_PIN_WIDE(p)                  (IS_PIN_ANALOG(p) || IS_PIN_PWM(p))
+#define PIN_TO_WIDE(p)                  (IS_PIN_ANALOG(p) ? PIN_TO_ANALOG(p) : \
+                                         TOTAL_ANALOG_PINS + MUX_PORTS_BELOW(PIN_TO_MUX(p), MUX_OUT_PORT_MASK) * MUX_PORT_PINS + PIN_TO_MUX_CHANNEL(p))
+
 #endif /* Firmata_Boards_h */
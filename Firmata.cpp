@@ -16,13 +16,29 @@
 //******************************************************************************
 
 #include "Firmata.h"
+#include "MuxFraming.h"
 #include "HardwareSerial.h"
+#include <avr/pgmspace.h>
 
 extern "C" {
 #include <string.h>
 #include <stdlib.h>
 }
 
+/* data bytes following each FIRMATA_COMMAND_SLOT, 0 = not a callbackFunction command */
+static const byte commandDataBytes[16] PROGMEM = {
+  0, 0, 0, 0,
+  2, // SET_PIN_MODE
+  2, // SET_DIGITAL_PIN_VALUE
+  0, 0, 0,
+  2, // DIGITAL_MESSAGE
+  0, 0,
+  1, // REPORT_ANALOG
+  1, // REPORT_DIGITAL
+  2, // ANALOG_MESSAGE
+  0
+};
+
 //******************************************************************************
 //* Support Functions
 //******************************************************************************
@@ -33,16 +49,18 @@ extern "C" {
  */
 void FirmataClass::sendValueAsTwo7bitBytes(int value)
 {
-  FirmataStream->write(value & B01111111); // LSB
-  FirmataStream->write(value >> 7 & B01111111); // MSB
+  txPut(value & B01111111); // LSB
+  txPut(value >> 7 & B01111111); // MSB
 }
 
 /**
  * A helper method to write the beginning of a Sysex message transmission.
+ * The sysex is queued as one frame when endSysex() is called.
  */
 void FirmataClass::startSysex(void)
 {
-  FirmataStream->write(START_SYSEX);
+  startFrame();
+  txPut(START_SYSEX);
 }
 
 /**
@@ -50,7 +68,112 @@ void FirmataClass::startSysex(void)
  */
 void FirmataClass::endSysex(void)
 {
-  FirmataStream->write(END_SYSEX);
+  txPut(END_SYSEX);
+  endFrame();
+}
+
+/**
+ * Begin a frame in the output buffer. Frames may nest, only the outermost one is committed.
+ * @private
+ */
+void FirmataClass::startFrame(void)
+{
+  if (txFrameDepth++ == 0) {
+    txFrameStart = txHead;
+    txFrameOverflow = false;
+    txFraming = framedOutput;
+    if (txFraming) {
+      txCrc = 0xFFFF;
+      txCode = txHead;
+      txRun = 1;
+      txEmit(0); // code byte of the first block, patched when the block closes
+      txPut(txFrameType);
+      txPut(packetSequence);
+    }
+  }
+}
+
+/**
+ * Commit the current frame and push as much of the buffer as the transport will take without
+ * blocking. A frame that did not fit in the buffer is discarded whole and counted as dropped.
+ * @private
+ */
+void FirmataClass::endFrame(void)
+{
+  if (txFrameDepth == 0 || --txFrameDepth > 0) return;
+
+  if (txFraming) {
+    uint16_t crc = txCrc;
+
+    txStuff(crc & 0xFF);
+    txStuff(crc >> 8);
+    if (!txFrameOverflow) txBuffer[txCode] = txRun;
+    txEmit(0); // delimiter
+    txFraming = false;
+    if (!txFrameOverflow) packetSequence++;
+  }
+  txFrameType = MUX_FRAME_FIRMATA;
+
+  if (txFrameOverflow) {
+    txHead = txFrameStart;
+    txDroppedFrames++;
+  } else {
+    txCommitted = txHead;
+    processOutput();
+    if (txTail != txCommitted) txDeferredFrames++;
+  }
+}
+
+/**
+ * Add a byte to the frame being built. In framed output it goes into the CRC and is COBS encoded
+ * on the way in, so a packet needs no buffer of its own: the code byte of each block is written
+ * back into txBuffer when the block closes.
+ * @private
+ */
+void FirmataClass::txPut(byte c)
+{
+  if (txFraming) {
+    txCrc = muxFrameCrc(txCrc, c);
+    txStuff(c);
+  } else {
+    txEmit(c);
+  }
+}
+
+/**
+ * COBS encode one byte of a packet into the output buffer.
+ * @private
+ */
+void FirmataClass::txStuff(byte c)
+{
+  if (c) {
+    txEmit(c);
+    if (++txRun < 0xFF) return; // a full block of 254 has no implied zero
+  }
+  if (!txFrameOverflow) txBuffer[txCode] = txRun;
+  txCode = txHead;
+  txRun = 1;
+  txEmit(0);
+}
+
+/**
+ * Write a byte to the output buffer as it will be sent.
+ * @private
+ */
+void FirmataClass::txEmit(byte c)
+{
+  byte next = (txHead + 1) & (FIRMATA_TX_BUFFER_SIZE - 1);
+
+  if (txFrameOverflow) return;
+  if (next == txTail) {
+    processOutput(); // make room from frames already committed
+    if (next == txTail) {
+      txFrameOverflow = true;
+      return;
+    }
+  }
+  txBuffer[txHead] = c;
+  txHead = next;
 }
 
 //******************************************************************************
@@ -63,8 +186,41 @@ void FirmataClass::endSysex(void)
  */
 FirmataClass::FirmataClass()
 {
-  firmwareVersionCount = 0;
-  firmwareVersionVector = 0;
+  firmwareMajor = 0;
+  firmwareMinor = 0;
+  firmwareName = 0;
+  firmwareNameLength = 0;
+  firmwareNameInFlash = false;
+  sysexOverflows = 0;
+  sysexStream = 0;
+  for (byte i = 0; i < FIRMATA_MAX_STREAMS; i++) {
+    streamCallbacks[i] = 0;
+  }
+  FirmataStream = 0;
+  FirmataSerial = 0;
+  txHead = 0;
+  txTail = 0;
+  txCommitted = 0;
+  txFrameDepth = 0;
+  txFrameOverflow = false;
+  txDeferredFrames = 0;
+  txDroppedFrames = 0;
+  txBytes = 0;
+  txRoomMax = 0;
+  analogDirty = 0;
+  analogNext = 0;
+  analogCoalesced = 0;
+  replySource = 0;
+  txReplyAt = 0;
+  framedOutput = false;
+  txFrameType = MUX_FRAME_FIRMATA;
+  txFraming = false;
+  packetSequence = 0;
+  digitalDirty = 0;
+  for (byte i = 0; i < TOTAL_PORTS; i++) {
+    digitalSent[i] = 0;
+    digitalPending[i] = 0;
+  }
   systemReset();
 }
 
@@ -73,7 +229,7 @@ FirmataClass::FirmataClass()
 //******************************************************************************
 
 /**
- * Initialize the default Serial transport at the default baud of 57600.
+ * Initialize the default serial transport (FIRMATA_SERIAL) at the default baud of 57600.
  */
 void FirmataClass::begin(void)
 {
@@ -81,7 +237,7 @@ void FirmataClass::begin(void)
 }
 
 /**
- * Initialize the default Serial transport and override the default baud.
+ * Initialize the default serial transport (FIRMATA_SERIAL) and override the default baud.
  * Sends the protocol version to the host application followed by the firmware version and name.
  * blinkVersion is also called. To skip the call to blinkVersion, call Firmata.disableBlinkVersion()
  * before calling Firmata.begin(baud).
@@ -89,8 +245,9 @@ void FirmataClass::begin(void)
  */
 void FirmataClass::begin(long speed)
 {
-  Serial.begin(speed);
-  FirmataStream = &Serial;
+  FIRMATA_SERIAL.begin(speed);
+  FirmataStream = &FIRMATA_SERIAL;
+  FirmataSerial = &FIRMATA_SERIAL;
   blinkVersion();
   printVersion();         // send the protocol version
   printFirmwareVersion(); // send the firmware name and version
@@ -105,20 +262,34 @@ void FirmataClass::begin(long speed)
 void FirmataClass::begin(Stream &s)
 {
   FirmataStream = &s;
+  FirmataSerial = 0;
   // do not call blinkVersion() here because some hardware such as the
   // Ethernet shield use pin 13
   printVersion();
   printFirmwareVersion();
 }
 
+/**
+ * Reassign the Firmata stream transport to a hardware UART. Output is then only pushed as fast
+ * as the UART's own TX buffer has room, so sending never blocks.
+ * @param s A reference to the UART transport object (Uart, or Serial without MUX_SERIAL_TRANSPORT).
+ */
+void FirmataClass::begin(FirmataSerialClass &s)
+{
+  begin((Stream &)s);
+  FirmataSerial = &s;
+}
+
 /**
  * Send the Firmata protocol version to the Firmata host application.
  */
 void FirmataClass::printVersion(void)
 {
-  FirmataStream->write(REPORT_VERSION);
-  FirmataStream->write(FIRMATA_PROTOCOL_MAJOR_VERSION);
-  FirmataStream->write(FIRMATA_PROTOCOL_MINOR_VERSION);
+  startFrame();
+  txPut(REPORT_VERSION);
+  txPut(FIRMATA_PROTOCOL_MAJOR_VERSION);
+  txPut(FIRMATA_PROTOCOL_MINOR_VERSION);
+  endFrame();
 }
 
 /**
@@ -154,19 +325,19 @@ void FirmataClass::disableBlinkVersion()
 /**
  * Sends the firmware name and version to the Firmata host application. The major and minor version
  * numbers are the first 2 bytes in the message. The following bytes are the characters of the
- * firmware name.
+ * firmware name, read straight from flash or RAM wherever it was set.
  */
 void FirmataClass::printFirmwareVersion(void)
 {
   byte i;
 
-  if (firmwareVersionCount) { // make sure that the name has been set before reporting
+  if (firmwareName) { // make sure that the name has been set before reporting
     startSysex();
-    FirmataStream->write(REPORT_FIRMWARE);
-    FirmataStream->write(firmwareVersionVector[0]); // major version number
-    FirmataStream->write(firmwareVersionVector[1]); // minor version number
-    for (i = 2; i < firmwareVersionCount; ++i) {
-      sendValueAsTwo7bitBytes(firmwareVersionVector[i]);
+    txPut(REPORT_FIRMWARE);
+    txPut(firmwareMajor); // major version number
+    txPut(firmwareMinor); // minor version number
+    for (i = 0; i < firmwareNameLength; ++i) {
+      sendValueAsTwo7bitBytes(firmwareNameInFlash ? pgm_read_byte(firmwareName + i) : firmwareName[i]);
     }
     endSysex();
   }
@@ -175,13 +346,13 @@ void FirmataClass::printFirmwareVersion(void)
 /**
  * Sets the name and version of the firmware. This is not the same version as the Firmata protocol
  * (although at times the firmware version and protocol version may be the same number).
- * @param name A pointer to the name char array
+ * The name is not copied, it must stay valid (a string literal such as __FILE__ does).
+ * @param name A pointer to the name char array, a path and ".cpp" are left out of the report
  * @param major The major version number
  * @param minor The minor version number
  */
 void FirmataClass::setFirmwareNameAndVersion(const char *name, byte major, byte minor)
 {
-  const char *firmwareName;
   const char *extension;
 
   // parse out ".cpp" and "applet/" that comes from using __FILE__
@@ -200,19 +371,30 @@ void FirmataClass::setFirmwareNameAndVersion(const char *name, byte major, byte
   }
 
   if (!extension) {
-    firmwareVersionCount = strlen(firmwareName) + 2;
+    firmwareNameLength = strlen(firmwareName);
   } else {
-    firmwareVersionCount = extension - firmwareName + 2;
+    firmwareNameLength = extension - firmwareName;
   }
 
-  // in case anyone calls setFirmwareNameAndVersion more than once
-  free(firmwareVersionVector);
+  firmwareNameInFlash = false;
+  firmwareMajor = major;
+  firmwareMinor = minor;
+}
 
-  firmwareVersionVector = (byte *) malloc(firmwareVersionCount + 1);
-  firmwareVersionVector[firmwareVersionCount] = 0;
-  firmwareVersionVector[0] = major;
-  firmwareVersionVector[1] = minor;
-  strncpy((char *)firmwareVersionVector + 2, firmwareName, firmwareVersionCount - 2);
+/**
+ * Sets the name and version of the firmware with a name kept in flash. Nothing is parsed or
+ * copied, printFirmwareVersion() streams the name from flash.
+ * @param name A PSTR() or PROGMEM name, reported as it is
+ * @param major The major version number
+ * @param minor The minor version number
+ */
+void FirmataClass::setFirmwareNameAndVersion_P(const char *name, byte major, byte minor)
+{
+  firmwareName = name;
+  firmwareNameLength = strlen_P(name);
+  firmwareNameInFlash = true;
+  firmwareMajor = major;
+  firmwareMinor = minor;
 }
 
 //------------------------------------------------------------------------------
@@ -241,6 +423,7 @@ void FirmataClass::processSysexMessage(void)
     case STRING_DATA:
       if (currentStringCallback) {
         byte bufferLength = (sysexBytesRead - 1) / 2;
+        if (bufferLength == 0) break;
         byte i = 1;
         byte j = 0;
         while (j < bufferLength) {
@@ -278,88 +461,158 @@ void FirmataClass::processInput(void)
   }
 }
 
+/**
+ * Drain the input stream in chunks of up to FIRMATA_RX_CHUNK bytes and parse each chunk in one
+ * call. Use it in place of a while (available()) processInput() loop. With MuxSerial the chunks
+ * are parsed in its receive ring, other streams are copied out a chunk at a time.
+ * @param limit Stop once about this many bytes have been parsed (rounded up to a whole chunk),
+ * by default the stream is drained.
+ * @return The number of bytes parsed.
+ */
+size_t FirmataClass::processInputBulk(size_t limit)
+{
+  size_t length, total = 0;
+#if MUX_SERIAL_TRANSPORT
+  const byte *block;
+#endif
+
+  while (total < limit) {
+#if MUX_SERIAL_TRANSPORT
+    if (FirmataSerial) {
+      length = FirmataSerial->peekBlock(&block);
+      if (length > FIRMATA_RX_CHUNK) length = FIRMATA_RX_CHUNK;
+      if (length == 0) break;
+      parse(block, length);
+      FirmataSerial->consume(length); // after a rate change the ring was emptied and this does nothing
+    } else
+#endif
+    {
+      length = processInputChunk();
+      if (length == 0) break;
+    }
+    total += length;
+  }
+  return total;
+}
+
+/**
+ * Copy up to FIRMATA_RX_CHUNK bytes out of a stream and parse them. Kept out of line so its
+ * buffer is only on the stack on this path.
+ * @return The number of bytes parsed.
+ */
+__attribute__((noinline)) size_t FirmataClass::processInputChunk(void)
+{
+  byte buffer[FIRMATA_RX_CHUNK];
+  size_t length = FirmataStream->available();
+
+  if (length > FIRMATA_RX_CHUNK) length = FIRMATA_RX_CHUNK;
+  if (length > 0) FirmataStream->readBytes(buffer, length); // the bytes are already there, so this doesn't wait
+  parse(buffer, length);
+  return length;
+}
+
+/**
+ * Parse a block of data from the input stream. Complete 3 byte messages met while the parser is
+ * idle (ANALOG_MESSAGE, DIGITAL_MESSAGE, SET_PIN_MODE and SET_DIGITAL_PIN_VALUE) are dispatched
+ * straight from the buffer, everything else goes through parse(byte).
+ * @param buffer The received bytes.
+ * @param length The number of bytes in buffer.
+ */
+void FirmataClass::parse(const byte *buffer, size_t length)
+{
+  const byte *end = buffer + length;
+  byte slot;
+
+  while (buffer < end) {
+    if (!parsingSysex && !waitForData && end - buffer >= 3
+        && buffer[0] >= 0x80 && buffer[1] < 0x80 && buffer[2] < 0x80
+        && FIRMATA_IS_TABLE_COMMAND(buffer[0])) {
+      slot = FIRMATA_COMMAND_SLOT(buffer[0]);
+      if (pgm_read_byte(&commandDataBytes[slot]) == 2) {
+        dispatchCommand(slot, buffer[0] & 0x0F, buffer[1], buffer[2]);
+        buffer += 3;
+        continue;
+      }
+    }
+    parse(*buffer++);
+  }
+}
+
+/**
+ * Call the callback attached to a command slot with the arguments shaped for that command:
+ * (channel, 14 bit value), (channel, byte) or, for SET_PIN_MODE and SET_DIGITAL_PIN_VALUE,
+ * (pin, value).
+ * @private
+ */
+inline void FirmataClass::dispatchCommand(byte slot, byte channel, byte first, byte second)
+{
+  callbackFunction callback = commandCallbacks[slot];
+
+  if (!callback) return;
+  if (slot == (SET_PIN_MODE & 0x0F) || slot == (SET_DIGITAL_PIN_VALUE & 0x0F))
+    (*callback)(first, second);
+  else if (pgm_read_byte(&commandDataBytes[slot]) == 2)
+    (*callback)(channel, first | (second << 7));
+  else
+    (*callback)(channel, first);
+}
+
 /**
  * Parse data from the input stream.
  * @param inputData A single byte to be added to the parser.
  */
 void FirmataClass::parse(byte inputData)
 {
-  int command;
+  byte slot;
+
+  // a new message or a reset before END_SYSEX cuts the open one off, its stream handler forgets it
+  if (parsingSysex && (inputData == START_SYSEX || inputData == SYSTEM_RESET))
+    abortSysex();
 
   if (parsingSysex) {
     if (inputData == END_SYSEX) {
       //stop sysex byte
       parsingSysex = false;
-      //fire off handler function
-      processSysexMessage();
-    } else {
+      if (sysexBytesRead == 1)
+        findSysexStream(); // a message with no data, the lookup below never ran
+      if (sysexDiscard)
+        sysexDiscard = false; // already counted and aborted when it overflowed
+      else if (sysexStream)
+        (*sysexStream)(storedInputData[0], FIRMATA_STREAM_END, sysexBytesRead - 1, storedInputData + 1);
+      else if (sysexBytesRead > 0)
+        //fire off handler function
+        processSysexMessage();
+    } else if (!sysexDiscard) {
       //normal data byte - add to buffer
-      storedInputData[sysexBytesRead] = inputData;
-      sysexBytesRead++;
+      storeSysexByte(inputData);
     }
   } else if ( (waitForData > 0) && (inputData < 128) ) {
     waitForData--;
     storedInputData[waitForData] = inputData;
     if ( (waitForData == 0) && executeMultiByteCommand ) { // got the whole message
-      switch (executeMultiByteCommand) {
-        case ANALOG_MESSAGE:
-          if (currentAnalogCallback) {
-            (*currentAnalogCallback)(multiByteChannel,
-                                     (storedInputData[0] << 7)
-                                     + storedInputData[1]);
-          }
-          break;
-        case DIGITAL_MESSAGE:
-          if (currentDigitalCallback) {
-            (*currentDigitalCallback)(multiByteChannel,
-                                      (storedInputData[0] << 7)
-                                      + storedInputData[1]);
-          }
-          break;
-        case SET_PIN_MODE:
-          if (currentPinModeCallback)
-            (*currentPinModeCallback)(storedInputData[1], storedInputData[0]);
-          break;
-        case SET_DIGITAL_PIN_VALUE:
-          if (currentPinValueCallback)
-            (*currentPinValueCallback)(storedInputData[1], storedInputData[0]);
-          break;
-        case REPORT_ANALOG:
-          if (currentReportAnalogCallback)
-            (*currentReportAnalogCallback)(multiByteChannel, storedInputData[0]);
-          break;
-        case REPORT_DIGITAL:
-          if (currentReportDigitalCallback)
-            (*currentReportDigitalCallback)(multiByteChannel, storedInputData[0]);
-          break;
-      }
+      // data bytes are stored last to first
+      slot = FIRMATA_COMMAND_SLOT(executeMultiByteCommand);
+      if (pgm_read_byte(&commandDataBytes[slot]) == 2)
+        dispatchCommand(slot, multiByteChannel, storedInputData[1], storedInputData[0]);
+      else
+        dispatchCommand(slot, multiByteChannel, storedInputData[0], 0);
       executeMultiByteCommand = 0;
     }
-  } else {
+  } else if (inputData >= 0x80 && FIRMATA_IS_TABLE_COMMAND(inputData)) {
+    // a stray data byte would otherwise land in the SET_PIN_MODE or SET_DIGITAL_PIN_VALUE slot
     // remove channel info from command byte if less than 0xF0
-    if (inputData < 0xF0) {
-      command = inputData & 0xF0;
-      multiByteChannel = inputData & 0x0F;
-    } else {
-      command = inputData;
-      // commands in the 0xF* range don't use channel data
-    }
-    switch (command) {
-      case ANALOG_MESSAGE:
-      case DIGITAL_MESSAGE:
-      case SET_PIN_MODE:
-      case SET_DIGITAL_PIN_VALUE:
-        waitForData = 2; // two data bytes needed
-        executeMultiByteCommand = command;
-        break;
-      case REPORT_ANALOG:
-      case REPORT_DIGITAL:
-        waitForData = 1; // one data byte needed
-        executeMultiByteCommand = command;
-        break;
+    multiByteChannel = inputData & 0x0F;
+    slot = FIRMATA_COMMAND_SLOT(inputData);
+    waitForData = pgm_read_byte(&commandDataBytes[slot]);
+    executeMultiByteCommand = waitForData ? inputData : 0;
+  } else {
+    // commands in the 0xF* range don't use channel data
+    switch (inputData) {
       case START_SYSEX:
         parsingSysex = true;
         sysexBytesRead = 0;
+        sysexDiscard = false;
+        sysexStream = 0;
         break;
       case SYSTEM_RESET:
         systemReset();
@@ -371,6 +624,67 @@ void FirmataClass::parse(byte inputData)
   }
 }
 
+/**
+ * Add a data byte to the sysex being received. A full buffer is first offered to the stream
+ * handler of the command, if there is one. When no room can be made the message is dropped up
+ * to END_SYSEX and counted in getSysexOverflows().
+ * @private
+ * @param inputData A sysex data byte.
+ */
+void FirmataClass::storeSysexByte(byte inputData)
+{
+  byte used;
+
+  if (sysexBytesRead == 1) // the command byte is in, look up its stream handler once
+    findSysexStream();
+
+  if (sysexBytesRead >= MAX_DATA_BYTES && sysexStream) {
+    used = (*sysexStream)(storedInputData[0], FIRMATA_STREAM_MORE, sysexBytesRead - 1, storedInputData + 1);
+    if (used > sysexBytesRead - 1) used = sysexBytesRead - 1;
+    if (used) {
+      memmove(storedInputData + 1, storedInputData + 1 + used, sysexBytesRead - 1 - used);
+      sysexBytesRead -= used;
+    }
+  }
+
+  if (sysexBytesRead >= MAX_DATA_BYTES) {
+    sysexDiscard = true;
+    sysexOverflows++;
+    if (sysexStream) (*sysexStream)(storedInputData[0], FIRMATA_STREAM_ABORT, 0, storedInputData + 1);
+    return;
+  }
+
+  storedInputData[sysexBytesRead] = inputData;
+  sysexBytesRead++;
+}
+
+/**
+ * Set sysexStream to the stream handler of the command in storedInputData[0], if it has one.
+ * @private
+ */
+void FirmataClass::findSysexStream(void)
+{
+  byte i;
+
+  for (i = 0; i < FIRMATA_MAX_STREAMS; i++) {
+    if (streamCallbacks[i] && streamCommands[i] == storedInputData[0]) sysexStream = streamCallbacks[i];
+  }
+}
+
+/**
+ * Drop the sysex being received. Its stream handler, if it has one and it wasn't told already,
+ * gets FIRMATA_STREAM_ABORT with the command still in the buffer.
+ * @private
+ */
+void FirmataClass::abortSysex(void)
+{
+  if (sysexStream && !sysexDiscard)
+    (*sysexStream)(storedInputData[0], FIRMATA_STREAM_ABORT, 0, storedInputData + 1);
+  parsingSysex = false;
+  sysexDiscard = false;
+  sysexStream = 0;
+}
+
 /**
  * @return Returns true if the parser is actively parsing data.
  */
@@ -387,42 +701,62 @@ boolean FirmataClass::isParsingMessage(void)
  * when using the ANALOG_MESSAGE. The maximum value of the ANALOG_MESSAGE is limited to 14 bits
  * (16384). To increase the pin range or value, see the documentation for the EXTENDED_ANALOG
  * message.
+ * Analog values are bulk telemetry: they are held as the newest value per pin and only written
+ * once every queued event (digital changes, sysex replies) has gone out. A value that is
+ * replaced before it could be sent is counted by getCoalescedAnalog().
  * @param pin The analog pin to send the value of (limited to pins 0 - 15).
  * @param value The value of the analog pin (0 - 1024 for 10-bit analog, 0 - 4096 for 12-bit, etc).
  * The maximum value is 14-bits (16384).
  */
 void FirmataClass::sendAnalog(byte pin, int value)
 {
+  if (framedOutput) return; // the sweep goes out whole as a MUX_FRAME_ANALOG packet
+
   // pin can only be 0-15, so chop higher bits
-  FirmataStream->write(ANALOG_MESSAGE | (pin & 0xF));
-  sendValueAsTwo7bitBytes(value);
+  pin &= 0xF;
+  if (bitRead(analogDirty, pin)) analogCoalesced++;
+  analogPending[pin] = value;
+  bitSet(analogDirty, pin);
+  processOutput();
 }
 
-/* (intentionally left out asterix here)
- * STUB - NOT IMPLEMENTED
- * Send a single digital pin value to the Firmata host application.
+/**
+ * Send a single digital pin value to the Firmata host application. The value is held in its
+ * port until flushDigital(), so changes to several pins of a port go out as one DIGITAL_MESSAGE.
+ * A pin that changes again before the flush first flushes its port, so the host sees every change.
  * @param pin The digital pin to send the value of.
  * @param value The value of the pin.
  */
 void FirmataClass::sendDigital(byte pin, int value)
 {
-  /* TODO add single pin digital messages to the protocol, this needs to
-   * track the last digital data sent so that it can be sure to change just
-   * one bit in the packet.  This is complicated by the fact that the
-   * numbering of the pins will probably differ on Arduino, Wiring, and
-   * other boards.
-   */
+  byte port = pin >> 3, mask = 1 << (pin & 7);
+  byte pending;
+
+  if (port >= TOTAL_PORTS) return;
 
-  // TODO: the digital message should not be sent on the serial port every
-  // time sendDigital() is called.  Instead, it should add it to an int
-  // which will be sent on a schedule.  If a pin changes more than once
-  // before the digital message is sent on the serial port, it should send a
-  // digital message for each change.
+  pending = value ? digitalPending[port] | mask : digitalPending[port] & ~mask;
+  if (pending == digitalPending[port]) return;
 
-  //    if(value == 0)
-  //        sendDigitalPortPair();
+  if ((digitalPending[port] ^ digitalSent[port]) & mask) { // second change of this pin since the last flush
+    sendDigitalPort(port, digitalPending[port]);
+  }
+  digitalPending[port] = pending;
+  if (digitalPending[port] != digitalSent[port]) bitSet(digitalDirty, port);
+  else bitClear(digitalDirty, port);
 }
 
+/**
+ * Send the ports changed by sendDigital() since the last flush, one DIGITAL_MESSAGE each.
+ * Call it at the end of each scan of the inputs.
+ */
+void FirmataClass::flushDigital(void)
+{
+  byte port;
+
+  for (port = 0; digitalDirty && port < TOTAL_PORTS; port++) {
+    if (bitRead(digitalDirty, port)) sendDigitalPort(port, digitalPending[port]);
+  }
+}
 
 /**
  * Send an 8-bit port in a single digital message (protocol v2 and later).
@@ -434,9 +768,17 @@ void FirmataClass::sendDigital(byte pin, int value)
  */
 void FirmataClass::sendDigitalPort(byte portNumber, int portData)
 {
-  FirmataStream->write(DIGITAL_MESSAGE | (portNumber & 0xF));
-  FirmataStream->write((byte)portData % 128); // Tx bits 0-6 (protocol v1 and higher)
-  FirmataStream->write(portData >> 7);  // Tx bits 7-13 (bit 7 only for protocol v2 and higher)
+  if (portNumber < TOTAL_PORTS) { // keep sendDigital() in step with whole port sends
+    digitalSent[portNumber] = portData;
+    digitalPending[portNumber] = portData;
+    bitClear(digitalDirty, portNumber);
+  }
+
+  startFrame();
+  txPut(DIGITAL_MESSAGE | (portNumber & 0xF));
+  txPut((byte)portData % 128); // Tx bits 0-6 (protocol v1 and higher)
+  txPut(portData >> 7);  // Tx bits 7-13 (bit 7 only for protocol v2 and higher)
+  endFrame();
 }
 
 /**
@@ -450,7 +792,7 @@ void FirmataClass::sendSysex(byte command, byte bytec, byte *bytev)
 {
   byte i;
   startSysex();
-  FirmataStream->write(command);
+  txPut(command);
   for (i = 0; i < bytec; i++) {
     sendValueAsTwo7bitBytes(bytev[i]);
   }
@@ -479,13 +821,191 @@ void FirmataClass::sendString(const char *string)
 }
 
 /**
- * A wrapper for Stream::available().
- * Write a single byte to the output stream.
+ * Write a single byte to the output stream. Between startSysex() and endSysex() the byte is
+ * added to the sysex frame, otherwise it is queued as a frame of its own.
  * @param c The byte to be written.
  */
 void FirmataClass::write(byte c)
 {
-  FirmataStream->write(c);
+  startFrame();
+  txPut(c);
+  endFrame();
+}
+
+/**
+ * Push committed frames from the output buffer to the transport with bulk writes. On a hardware
+ * UART only as many bytes as its TX buffer has room for are written, so this never blocks.
+ * Call it regularly from the main loop to drain frames that were deferred.
+ */
+void FirmataClass::processOutput(void)
+{
+  int room;
+  byte count, end;
+  byte chunk[FIRMATA_REPLY_CHUNK];
+
+  if (!FirmataStream) return;
+
+  // a plain Stream can't report its free space, it just blocks as it always did
+  room = FirmataSerial ? FirmataSerial->availableForWrite() : 0x7FFF;
+  if (room > txRoomMax) txRoomMax = room;
+
+  for (;;) {
+    // frames queued before a reply go out first, frames queued after it wait until it is complete
+    end = replySource ? txReplyAt : txCommitted;
+    while (txTail != end && room > 0) {
+      // write the contiguous run up to the end of the committed data or the end of the buffer
+      count = (end > txTail) ? end - txTail : FIRMATA_TX_BUFFER_SIZE - txTail;
+      if (count > room) count = room;
+      FirmataStream->write(txBuffer + txTail, count);
+      txTail = (txTail + count) & (FIRMATA_TX_BUFFER_SIZE - 1);
+      txBytes += count;
+      room -= count;
+    }
+    if (!replySource || txTail != end || room <= 0) break;
+
+    count = (*replySource)(chunk, room < FIRMATA_REPLY_CHUNK ? room : FIRMATA_REPLY_CHUNK);
+    if (count == 0) {
+      replySource = 0; // complete, carry on with the frames that waited
+      continue;
+    }
+    FirmataStream->write(chunk, count);
+    txBytes += count;
+    room -= count;
+  }
+
+  // telemetry never overtakes an event and only keeps a couple of messages queued in the UART,
+  // an event queued next waits behind those rather than behind a buffer full of stale values
+  if (!replySource && txTail == txCommitted && analogDirty) {
+    sendPendingAnalog(room - (txRoomMax - FIRMATA_ANALOG_HEADROOM));
+  }
+}
+
+/**
+ * Send a payload as one MuxFraming packet of the given type. Does nothing unless the output is
+ * framed, a Firmata host would not understand it.
+ * @param type The packet type, such as MUX_FRAME_DIGITAL or MUX_FRAME_ANALOG.
+ * @param payload The packet data, 8 bits per byte.
+ * @param length The number of bytes in payload.
+ * @return false if the packet was not sent, or could not be queued and was dropped.
+ */
+boolean FirmataClass::sendPacket(byte type, const byte *payload, byte length)
+{
+  byte i;
+
+  if (!framedOutput) return false;
+
+  txFrameType = type; // before startFrame(), the type opens the packet
+  startFrame();
+  for (i = 0; i < length; i++) {
+    txPut(payload[i]);
+  }
+  endFrame();
+  return !txFrameOverflow;
+}
+
+/**
+ * Switch the output between Firmata messages and MuxFraming packets. Frames already queued go
+ * out as they were built, analog values not yet sent are dropped.
+ * @param framed true to send every following frame as a packet.
+ */
+void FirmataClass::setFramed(boolean framed)
+{
+  framedOutput = framed;
+  analogDirty = 0;
+  packetSequence = 0;
+}
+
+/**
+ * Queue a reply too long for the output buffer, such as CAPABILITY_RESPONSE. The source is asked
+ * for the next bytes whenever the transport has room, so the reply never blocks the caller; it
+ * must end on a message boundary. Frames committed while it is sent wait in the output buffer.
+ * @param source Writes the next part of the reply, returns 0 once the reply is complete.
+ * @return false if another reply is still being sent, or the output is framed.
+ */
+boolean FirmataClass::sendReply(replyCallbackFunction source)
+{
+  if (replySource || framedOutput) return false; // the source writes raw bytes, they can't be framed
+
+  txReplyAt = txCommitted;
+  replySource = source;
+  processOutput();
+  return true;
+}
+
+/**
+ * Block until every queued frame has been written and the UART has shifted out its last byte,
+ * for instance before the baud rate is changed. Pending analog values are left for later.
+ */
+void FirmataClass::flushOutput(void)
+{
+  while (txTail != txCommitted) processOutput();
+  if (FirmataSerial) FirmataSerial->flush();
+}
+
+/**
+ * Write pending analog values straight to the transport, round robin from where the last call
+ * stopped, as long as there is room for a whole message. Values left behind are coalesced, so
+ * the host gets the newest one when the room comes.
+ * @param room The bytes that may be written, FIRMATA_ANALOG_HEADROOM less what the transport
+ * still holds.
+ * @private
+ */
+void FirmataClass::sendPendingAnalog(int room)
+{
+  byte message[3];
+
+  while (analogDirty && room >= 3) {
+    while (!bitRead(analogDirty, analogNext)) analogNext = (analogNext + 1) & 0xF;
+    message[0] = ANALOG_MESSAGE | analogNext;
+    message[1] = analogPending[analogNext] & B01111111; // LSB
+    message[2] = analogPending[analogNext] >> 7 & B01111111; // MSB
+    FirmataStream->write(message, 3);
+    bitClear(analogDirty, analogNext);
+    analogNext = (analogNext + 1) & 0xF;
+    txBytes += 3;
+    room -= 3;
+  }
+}
+
+/**
+ * @return The number of frames that could not be written straight to the transport and waited
+ * in the output buffer.
+ */
+unsigned long FirmataClass::getDeferredFrames(void)
+{
+  return txDeferredFrames;
+}
+
+/**
+ * @return The number of frames discarded because the output buffer was full.
+ */
+unsigned long FirmataClass::getDroppedFrames(void)
+{
+  return txDroppedFrames;
+}
+
+/**
+ * @return The number of analog values replaced by a newer one before they could be sent.
+ */
+unsigned long FirmataClass::getCoalescedAnalog(void)
+{
+  return analogCoalesced;
+}
+
+/**
+ * @return The number of bytes handed to the transport since startup.
+ */
+unsigned long FirmataClass::getBytesSent(void)
+{
+  return txBytes;
+}
+
+/**
+ * @return The number of sysex messages dropped because they outgrew the input buffer.
+ */
+unsigned int FirmataClass::getSysexOverflows(void)
+{
+  return sysexOverflows;
 }
 
 /**
@@ -496,14 +1016,10 @@ void FirmataClass::write(byte c)
  */
 void FirmataClass::attach(byte command, callbackFunction newFunction)
 {
-  switch (command) {
-    case ANALOG_MESSAGE: currentAnalogCallback = newFunction; break;
-    case DIGITAL_MESSAGE: currentDigitalCallback = newFunction; break;
-    case REPORT_ANALOG: currentReportAnalogCallback = newFunction; break;
-    case REPORT_DIGITAL: currentReportDigitalCallback = newFunction; break;
-    case SET_PIN_MODE: currentPinModeCallback = newFunction; break;
-    case SET_DIGITAL_PIN_VALUE: currentPinValueCallback = newFunction; break;
-  }
+  byte slot = FIRMATA_COMMAND_SLOT(command);
+
+  if (FIRMATA_IS_TABLE_COMMAND(command) && pgm_read_byte(&commandDataBytes[slot]))
+    commandCallbacks[slot] = newFunction;
 }
 
 /**
@@ -540,6 +1056,30 @@ void FirmataClass::attach(byte command, sysexCallbackFunction newFunction)
   currentSysexCallback = newFunction;
 }
 
+/**
+ * Attach a stream handler to one sysex command. The handler gets the message in pieces: each
+ * time the sysex buffer fills (FIRMATA_STREAM_MORE), then the rest at END_SYSEX
+ * (FIRMATA_STREAM_END), or FIRMATA_STREAM_ABORT if the message had to be dropped. Messages of
+ * that command no longer reach the generic sysex callback.
+ * @param command The sysex command, the first byte after START_SYSEX.
+ * @param newFunction The stream handler, NULL to remove it.
+ * @return false if all FIRMATA_MAX_STREAMS handlers are in use.
+ */
+boolean FirmataClass::attachSysexStream(byte command, sysexStreamCallbackFunction newFunction)
+{
+  byte i, slot = FIRMATA_MAX_STREAMS;
+
+  for (i = 0; i < FIRMATA_MAX_STREAMS; i++) {
+    if (streamCallbacks[i] && streamCommands[i] == command) slot = i;
+    else if (!streamCallbacks[i] && slot == FIRMATA_MAX_STREAMS) slot = i;
+  }
+  if (slot == FIRMATA_MAX_STREAMS) return false;
+
+  streamCommands[slot] = command;
+  streamCallbacks[slot] = newFunction;
+  return true;
+}
+
 /**
  * Detach a callback function for a specified command (such as SYSTEM_RESET, STRING_DATA,
  * ANALOG_MESSAGE, DIGITAL_MESSAGE, etc).
@@ -562,7 +1102,9 @@ void FirmataClass::detach(byte command)
  */
 byte FirmataClass::getPinMode(byte pin)
 {
-  return pinConfig[pin];
+  byte config = (pin & 1) ? pinConfig[pin >> 1] >> 4 : pinConfig[pin >> 1] & 0x0F;
+
+  return config == FIRMATA_MODE_IGNORE_NIBBLE ? PIN_MODE_IGNORE : config;
 }
 
 /**
@@ -570,14 +1112,23 @@ byte FirmataClass::getPinMode(byte pin)
  * current function of the pin. Examples are digital input or output, analog input, pwm, i2c,
  * serial (uart), etc.
  * @param pin The pin to configure.
- * @param config The configuration value for the specified pin.
+ * @param config The configuration value for the specified pin. Modes are stored in 4 bits, so
+ * apart from PIN_MODE_IGNORE only modes below 0x0F can be set.
  */
 void FirmataClass::setPinMode(byte pin, byte config)
 {
-  if (pinConfig[pin] == PIN_MODE_IGNORE)
+  if (getPinMode(pin) == PIN_MODE_IGNORE)
     return;
 
-  pinConfig[pin] = config;
+  if (config == PIN_MODE_IGNORE)
+    config = FIRMATA_MODE_IGNORE_NIBBLE;
+  else if (config >= FIRMATA_MODE_IGNORE_NIBBLE)
+    return;
+
+  if (pin & 1)
+    pinConfig[pin >> 1] = (pinConfig[pin >> 1] & 0x0F) | (config << 4);
+  else
+    pinConfig[pin >> 1] = (pinConfig[pin >> 1] & 0xF0) | config;
 }
 
 /**
@@ -586,18 +1137,26 @@ void FirmataClass::setPinMode(byte pin, byte config)
  */
 int FirmataClass::getPinState(byte pin)
 {
-  return pinState[pin];
+  if (IS_PIN_WIDE(pin))
+    return pinWideState[PIN_TO_WIDE(pin)];
+
+  return (pinState[pin >> 3] >> (pin & 7)) & 1;
 }
 
 /**
  * Set the pin state. The pin state of an output pin is the pin value. The state of an
  * input pin is 0, unless the pin has it's internal pull up resistor enabled, then the value is 1.
  * @param pin The pin to set the state of
- * @param state Set the state of the specified pin
+ * @param state Set the state of the specified pin, only IS_PIN_WIDE pins keep more than 0 or 1
  */
 void FirmataClass::setPinState(byte pin, int state)
 {
-  pinState[pin] = state;
+  if (IS_PIN_WIDE(pin))
+    pinWideState[PIN_TO_WIDE(pin)] = state;
+  else if (state)
+    pinState[pin >> 3] |= 1 << (pin & 7);
+  else
+    pinState[pin >> 3] &= ~(1 << (pin & 7));
 }
 
 // sysex callbacks
@@ -640,6 +1199,8 @@ void FirmataClass::systemReset(void)
 
   parsingSysex = false;
   sysexBytesRead = 0;
+  sysexDiscard = false;
+  sysexStream = 0;
 
   if (currentSystemResetCallback)
     (*currentSystemResetCallback)();
@@ -16,6 +16,15 @@
 
 #include "Boards.h"  /* Hardware Abstraction Layer + Wiring/Arduino */
 
+#if MUX_SERIAL_TRANSPORT
+#include "MuxSerial.h"
+#define FIRMATA_SERIAL Uart
+typedef MuxSerial FirmataSerialClass;
+#else
+#define FIRMATA_SERIAL Serial
+typedef HardwareSerial FirmataSerialClass;
+#endif
+
 /* Version numbers for the protocol.  The protocol is still changing, so these
  * version numbers are important.
  * Query using the REPORT_VERSION message.
@@ -39,7 +48,23 @@
 #define FIRMATA_MINOR_VERSION           5 // same as FIRMATA_PROTOCOL_MINOR_VERSION
 #define FIRMATA_BUGFIX_VERSION          1 // same as FIRMATA_PROTOCOL_BUGFIX_VERSION
 
-#define MAX_DATA_BYTES                  64 // max number of data bytes in incoming messages
+// max number of data bytes in incoming messages, half of stock Firmata's 64 to save RAM on 2 KB parts:
+// the longest message MuxFirmata takes whole is 13 bytes, longer sysex goes to a stream handler
+// (SEQUENCER_DATA) or is dropped up to END_SYSEX and counted in getSysexOverflows()
+#define MAX_DATA_BYTES                  32
+// callbackFunction commands are dispatched from a table: channel messages by their high nibble,
+// SET_PIN_MODE and SET_DIGITAL_PIN_VALUE by their low nibble (the slots don't overlap)
+#define FIRMATA_IS_TABLE_COMMAND(c)     ((c) < 0xF0 || (c) == SET_PIN_MODE || (c) == SET_DIGITAL_PIN_VALUE)
+#define FIRMATA_COMMAND_SLOT(c)         ((c) < 0xF0 ? (c) >> 4 : (c) & 0x0F)
+#define FIRMATA_RX_CHUNK                32 // bytes parsed per bulk read, copied to the stack unless the transport is MuxSerial
+#define FIRMATA_TX_BUFFER_SIZE          128 // outgoing frame buffer, must be a power of 2 no larger than 256
+#define FIRMATA_REPLY_CHUNK             16 // bytes asked of a reply source at a time
+#define FIRMATA_ANALOG_HEADROOM         6 // analog bytes allowed in the transport's TX buffer, two messages
+#define FIRMATA_MAX_STREAMS             2 // sysex commands that can have a stream handler
+#define FIRMATA_STREAM_MORE             0 // the sysex buffer is full, consume what you can
+#define FIRMATA_STREAM_END              1 // END_SYSEX, the rest of the message
+#define FIRMATA_STREAM_ABORT            2 // the message was dropped, forget any partial upload
+#define FIRMATA_MODE_IGNORE_NIBBLE      0x0F // pin modes are stored in 4 bits, 0x0F stands for PIN_MODE_IGNORE
 
 // Arduino 101 also defines SET_PIN_MODE as a macro in scss_registers.h
 #ifdef SET_PIN_MODE
@@ -63,6 +88,17 @@
 
 // extended command set using sysex (0-127/0x00-0x7F)
 /* 0x00-0x0F reserved for user-defined commands */
+#define KEYPAD_DATA             0x01 // MuxFirmata: configure the key matrix scanner, report key presses/releases
+#define PULSE_DATA              0x02 // MuxFirmata: schedule timed pulses on a mux output pin
+#define SEQUENCER_DATA          0x03 // MuxFirmata: upload, play and store output pattern sequences
+#define RULE_DATA               0x04 // MuxFirmata: configure and store threshold rules, report rules firing
+#define LINK_DATA               0x05 // MuxFirmata: configure adaptive sampling, report link utilisation
+#define RATE_DATA               0x06 // MuxFirmata: set, query and store the interval of each sampling/report class
+#define BAUD_DATA               0x07 // MuxFirmata: negotiate a faster serial baud rate
+#define JITTER_DATA             0x08 // MuxFirmata: report and reset sampling jitter statistics
+#define SNAPSHOT_DATA           0x09 // MuxFirmata: report every pin mode, output, input and analogue value at once
+#define BINARY_DATA             0x0A // MuxFirmata: switch the output to COBS/CRC framed packets (MuxFraming.h)
+#define DELTA_DATA              0x0B // MuxFirmata: send analogue sweeps as keyframes and deltas in binary mode
 #define SERIAL_MESSAGE          0x60 // communicate with serial devices, including other boards
 #define ENCODER_DATA            0x61 // reply with encoders current positions
 #define SERVO_CONFIG            0x70 // set max angle, minPulse, maxPulse, freq
@@ -123,6 +159,10 @@ extern "C" {
   typedef void (*systemResetCallbackFunction)(void);
   typedef void (*stringCallbackFunction)(char *);
   typedef void (*sysexCallbackFunction)(byte command, byte argc, byte *argv);
+  // return the data bytes consumed, the rest stays at the front of the buffer for the next call
+  typedef byte (*sysexStreamCallbackFunction)(byte command, byte event, byte argc, byte *argv);
+  // fill buffer with up to size bytes of a long reply, return the bytes written, 0 once it is complete
+  typedef byte (*replyCallbackFunction)(byte *buffer, byte size);
 }
 
 // TODO make it a subclass of a generic Serial/Stream base class
@@ -134,31 +174,48 @@ class FirmataClass
     void begin();
     void begin(long);
     void begin(Stream &s);
+    void begin(FirmataSerialClass &s);
     /* querying functions */
     void printVersion(void);
     void blinkVersion(void);
     void printFirmwareVersion(void);
     //void setFirmwareVersion(byte major, byte minor);  // see macro below
     void setFirmwareNameAndVersion(const char *name, byte major, byte minor);
+    void setFirmwareNameAndVersion_P(const char *name, byte major, byte minor); // name in flash (PSTR/PROGMEM)
     void disableBlinkVersion();
     /* serial receive handling */
     int available(void);
     void processInput(void);
+    size_t processInputBulk(size_t limit = (size_t)-1);
     void parse(unsigned char value);
+    void parse(const byte *buffer, size_t length);
     boolean isParsingMessage(void);
     /* serial send handling */
     void sendAnalog(byte pin, int value);
-    void sendDigital(byte pin, int value); // TODO implement this
+    void sendDigital(byte pin, int value); // queued per port until flushDigital()
     void sendDigitalPort(byte portNumber, int portData);
+    void flushDigital(void);
+    boolean sendReply(replyCallbackFunction source);
+    boolean sendPacket(byte type, const byte *payload, byte length);
+    void setFramed(boolean framed);
+    boolean isFramed(void) { return framedOutput; }
     void sendString(const char *string);
     void sendString(byte command, const char *string);
     void sendSysex(byte command, byte bytec, byte *bytev);
     void write(byte c);
+    void processOutput(void);
+    void flushOutput(void);
+    unsigned long getDeferredFrames(void);
+    unsigned long getDroppedFrames(void);
+    unsigned long getCoalescedAnalog(void);
+    unsigned long getBytesSent(void);
+    unsigned int getSysexOverflows(void);
     /* attach & detach callback functions to messages */
     void attach(byte command, callbackFunction newFunction);
     void attach(byte command, systemResetCallbackFunction newFunction);
     void attach(byte command, stringCallbackFunction newFunction);
     void attach(byte command, sysexCallbackFunction newFunction);
+    boolean attachSysexStream(byte command, sysexStreamCallbackFunction newFunction);
     void detach(byte command);
 
     /* access pin state and config */
@@ -175,9 +232,45 @@ class FirmataClass
 
   private:
     Stream *FirmataStream;
-    /* firmware name and version */
-    byte firmwareVersionCount;
-    byte *firmwareVersionVector;
+    FirmataSerialClass *FirmataSerial; // set when the transport can report its free TX space
+    /* output frame buffer */
+    byte txBuffer[FIRMATA_TX_BUFFER_SIZE];
+    byte txHead; // next byte written here
+    byte txTail; // next byte sent from here
+    byte txCommitted; // end of the last complete frame
+    byte txFrameStart;
+    byte txFrameDepth;
+    boolean txFrameOverflow;
+    unsigned long txDeferredFrames;
+    unsigned long txDroppedFrames;
+    unsigned long txBytes;
+    int txRoomMax; // largest free TX space seen, taken as the size of the transport's buffer
+    /* bulk telemetry, newest value per analog channel, sent only when no event frame is waiting */
+    int analogPending[16];
+    unsigned int analogDirty; // bit n set = analogPending[n] not yet sent
+    byte analogNext; // round robin position so every channel gets a turn
+    unsigned long analogCoalesced;
+    /* framed output: every frame is sent as a MuxFraming packet */
+    boolean framedOutput;
+    byte txFrameType; // packet type of the frame being built
+    byte packetSequence;
+    boolean txFraming; // the frame being built is COBS encoded as it is written
+    byte txCode; // where the code byte of its open COBS block is
+    byte txRun; // that code so far, 1 + data bytes
+    uint16_t txCrc;
+    /* long reply pulled from its source as the transport has room, frames committed later wait for it */
+    replyCallbackFunction replySource;
+    byte txReplyAt; // txCommitted when the reply was queued
+    /* single pin changes from sendDigital(), one DIGITAL_MESSAGE per touched port on flushDigital() */
+    byte digitalSent[TOTAL_PORTS]; // port values last sent to the host
+    byte digitalPending[TOTAL_PORTS];
+    unsigned int digitalDirty; // bit n set = digitalPending[n] differs from digitalSent[n]
+    /* firmware name and version, the name is streamed from where it was set, never copied */
+    byte firmwareMajor;
+    byte firmwareMinor;
+    const char *firmwareName; // 0 until a name is set
+    byte firmwareNameLength;
+    boolean firmwareNameInFlash;
     /* input message handling */
     byte waitForData; // this flag says the next serial input will be data
     byte executeMultiByteCommand; // execute this after getting multi-byte data
@@ -186,25 +279,37 @@ class FirmataClass
     /* sysex */
     boolean parsingSysex;
     int sysexBytesRead;
-    /* pin configuration */
-    byte pinConfig[TOTAL_PINS];
-    int pinState[TOTAL_PINS];
+    boolean sysexDiscard; // the message outgrew storedInputData, drop it up to END_SYSEX
+    unsigned int sysexOverflows;
+    sysexStreamCallbackFunction sysexStream; // handler of the message being received, if it has one
+    /* pin configuration, packed: a mode nibble and a state bit per pin, full state for IS_PIN_WIDE pins */
+    byte pinConfig[(TOTAL_PINS + 1) / 2]; // PIN_MODE_IGNORE is kept as FIRMATA_MODE_IGNORE_NIBBLE
+    byte pinState[(TOTAL_PINS + 7) / 8];
+    int pinWideState[TOTAL_WIDE_PINS];
 
     /* callback functions */
-    callbackFunction currentAnalogCallback;
-    callbackFunction currentDigitalCallback;
-    callbackFunction currentReportAnalogCallback;
-    callbackFunction currentReportDigitalCallback;
-    callbackFunction currentPinModeCallback;
-    callbackFunction currentPinValueCallback;
+    callbackFunction commandCallbacks[16]; // indexed by FIRMATA_COMMAND_SLOT(command)
     systemResetCallbackFunction currentSystemResetCallback;
     stringCallbackFunction currentStringCallback;
     sysexCallbackFunction currentSysexCallback;
+    byte streamCommands[FIRMATA_MAX_STREAMS];
+    sysexStreamCallbackFunction streamCallbacks[FIRMATA_MAX_STREAMS];
 
     boolean blinkVersionDisabled = false;
 
     /* private methods ------------------------------ */
     void processSysexMessage(void);
+    size_t processInputChunk(void);
+    void storeSysexByte(byte inputData);
+    void findSysexStream(void);
+    void abortSysex(void);
+    inline void dispatchCommand(byte slot, byte channel, byte first, byte second);
+    void startFrame(void);
+    void endFrame(void);
+    void txPut(byte c);
+    void txStuff(byte c);
+    void txEmit(byte c);
+    void sendPendingAnalog(int room);
     void systemReset(void);
     void strobeBlinkPin(byte pin, int count, int onInterval, int offInterval);
 };
@@ -215,10 +320,13 @@ extern FirmataClass Firmata;
  * MACROS
  *============================================================================*/
 
-/* shortcut for setFirmwareNameAndVersion() that uses __FILE__ to set the
- * firmware name.  It needs to be a macro so that __FILE__ is included in the
- * firmware source file rather than the library source file.
+/* shortcut for setFirmwareNameAndVersion_P() that reports FIRMATA_FIRMWARE_NAME
+ * from flash. Upstream parses __FILE__ at run time and copies it to the heap,
+ * define FIRMATA_FIRMWARE_NAME before including Firmata.h to rename the firmware.
  */
-#define setFirmwareVersion(x, y)   setFirmwareNameAndVersion(__FILE__, x, y)
+#ifndef FIRMATA_FIRMWARE_NAME
+#define FIRMATA_FIRMWARE_NAME      "MuxFirmata"
+#endif
+#define setFirmwareVersion(x, y)   setFirmwareNameAndVersion_P(PSTR(FIRMATA_FIRMWARE_NAME), x, y)
 
 #endif /* Firmata_h */
@@ -0,0 +1,24 @@
+/*
+MuxEEPROM.h - EEPROM address map for MuxFirmata.
+Each block starts with a magic byte so unprogrammed (0xFF) or foreign contents are ignored.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxEEPROM_h
+#define MuxEEPROM_h
+
+#include <avr/eeprom.h>
+
+#define EEPROM_SEQUENCER                0x000   // output pattern sequencer table (512 bytes)
+#define EEPROM_SEQUENCER_MAGIC          0x53
+
+#define EEPROM_RULES                    0x200   // threshold rule table (256 bytes)
+#define EEPROM_RULES_MAGIC              0x52
+
+#define EEPROM_RATES                    0x300   // sample and report intervals (64 bytes)
+#define EEPROM_RATES_MAGIC              0x54
+
+#endif
@@ -19,9 +19,20 @@
 */
 
 #include <Arduino.h>
+#include <util/atomic.h>
 
 #include "SendOnlySoftwareSerial.h"
 #include "MuxShields.h"
+#include "MuxKeypad.h"
+#include "MuxPWM.h"
+#include "MuxTimer.h"
+#include "MuxPulse.h"
+#include "MuxSequencer.h"
+#include "MuxRules.h"
+#include "MuxEEPROM.h"
+#include "MuxScheduler.h"
+#include "MuxSampler.h"
+#include "MuxFraming.h"
 #include "Firmata.h"
 
 extern "C" {
@@ -34,22 +45,101 @@ SendOnlySoftwareSerial SerialOut(13, false);
 
 MuxShield Mux;
 
-static boolean const bDebug = true;
+static boolean const bDebug = true;                 // SerialOut holds interrupts off for each character, MuxTimer catches up below 1mS
 static boolean const bRunOnce = false;
 static boolean const bSelfTest = false;
 static boolean const bSendStatus = true;
 static boolean const bSampleAnalog = true;
 static boolean const bSampleDigital = true;
 static boolean const bUseDigitalRate= true;
+static boolean const bSoftPWM = true;
+static boolean const bPulse = true;
+static boolean const bSequencer = true;
+static boolean const bRules = true;
+static boolean const bAdaptiveRate = true;
+static boolean const bTimedSampling = true;
+static boolean const bSampleFrames = true;         // the digital clock reads the inputs itself and queues frames, needs bTimedSampling
 
 static unsigned long const ulRateHardware = 57600;
 static unsigned long const ulRateSoftware = 19200;
+static unsigned long const aRatesHardware[] PROGMEM = {57600, 115200, 250000, 500000};   // exact or close divisors at 16 MHz with U2X
+// SerialOut holds interrupts off for about 0.5mS a character, the UART's 3 byte buffer covers that at 57600
+// and no faster: setBaud() turns the debug output off above this rate
+static unsigned long const ulRateDebugMax = 57600;
+// interrupts the UART receive interrupt can queue behind, in uS, estimated from the generated code:
+// the Timer2 tick with its pulse and sequencer callbacks and millis(). A frame sample is taken after
+// the tick with interrupts enabled, see MuxTimer::later(), and holds nothing off
+static unsigned int const uIsrTickUs = 30;
 
 static byte const bPortOff = 0;
 static byte const bPortOn = 255;
 
 static byte const bDebugLen = 220;
 
+static byte const bKeypadConfig = 0x00;
+static byte const bKeypadPress = 0x01;
+static byte const bKeypadRelease = 0x02;
+
+static byte const bPulseMicros = 0x01;
+
+static byte const bSeqClear = 0x00;
+static byte const bSeqSteps = 0x01;
+static byte const bSeqPlay = 0x02;
+static byte const bSeqStop = 0x03;
+static byte const bSeqSave = 0x04;
+static byte const bSeqLoad = 0x05;
+
+static byte const bRuleClear = 0x00;
+static byte const bRuleSet = 0x01;
+static byte const bRuleSave = 0x02;
+static byte const bRuleLoad = 0x03;
+static byte const bRuleFired = 0x04;
+
+static byte const bLinkQuery = 0x00;
+static byte const bLinkStatus = 0x01;
+static byte const bLinkConfig = 0x02;
+
+static byte const bRateQuery = 0x00;
+static byte const bRateStatus = 0x01;
+static byte const bRateSet = 0x02;
+static byte const bRateSave = 0x03;
+static byte const bRateLoad = 0x04;
+
+static byte const bBaudPropose = 0x00;
+static byte const bBaudAccept = 0x01;
+static byte const bBaudReject = 0x02;
+static byte const bBaudPing = 0x03;
+static byte const bBaudConfirm = 0x04;
+static byte const bBaudRevert = 0x05;
+
+static byte const bJitterQuery = 0x00;
+static byte const bJitterStatus = 0x01;
+static byte const bJitterReset = 0x02;
+
+static byte const bBinaryEnter = 0x00;
+static byte const bBinaryExit = 0x01;
+static byte const bBinaryStatus = 0x02;
+
+static byte const bDeltaOff = 0x00;
+static byte const bDeltaOn = 0x01;
+static byte const bDeltaResync = 0x02;
+static byte const bDeltaStatus = 0x03;
+static byte const bDeltaKeyframe = 32;              // sweeps from one keyframe to the next
+
+static byte const bSnapshotQuery = 0x00;
+static byte const bSnapshotReply = 0x01;
+
+static byte const bLinkHigh = 85;                   // % of the link in use above which sampling is stretched
+static byte const bLinkLow = 60;                    // % of the link in use below which sampling is tightened
+
+// CAPABILITY_RESPONSE entry of each kind of pin in Boards.h: mode, resolution pairs closed by 127
+static byte const aCapsNone[] PROGMEM       = {127};
+static byte const aCapsAnalog[] PROGMEM     = {PIN_MODE_ANALOG, 10, 127};
+static byte const aCapsInput[] PROGMEM      = {INPUT, 1, 127};
+static byte const aCapsPullup[] PROGMEM     = {INPUT, 1, PIN_MODE_PULLUP, 1, 127};
+static byte const aCapsOutput[] PROGMEM     = {OUTPUT, 1, 127};
+static byte const aCapsOutputPwm[] PROGMEM  = {OUTPUT, 1, PIN_MODE_PWM, PWM_PLANES, 127};
+
 static char const sStatusSerialUp[] PROGMEM     = "MuxFirmata Debugger";
 static char const sStatusRateHardware[] PROGMEM = "Serial rate main I/O  (bps): | ";
 static char const sStatusRateSoftware[] PROGMEM = "Serial rate debug out (bps): | ";   
@@ -68,6 +158,9 @@ static char const sStatusModes[] PROGMEM        = "  Port mode: ";
 static char const sStatusRead[] PROGMEM         = "  Port read:";
 static char const sStatusUptime[] PROGMEM       = "Up: ";
 static char const sStatusMem[] PROGMEM          = "Bytes free: ";
+static char const sStatusCycle[] PROGMEM        = "Max cycle (uS): ";
+static char const sStatusPwm[] PROGMEM          = "PWM plane/shift (uS): ";
+static char const sStatusDebugOff[] PROGMEM     = "Debug off, main I/O (bps): | ";
 
 static char const s16spaces[] PROGMEM           = "                ";
 static char const s7bits[] PROGMEM              = "0000000";
@@ -91,7 +184,6 @@ byte previousPINs[TOTAL_PORTS];
 byte portConfigInputs[TOTAL_PORTS];
 
 boolean isResetting = false;
-boolean isUp = false;
 boolean isOnce = false;
 
 byte testPort = MUX_PORT_6;
@@ -99,27 +191,64 @@ byte testCount = MUX_PORT_6;
 byte testPrevious = 0;
 boolean testMode = false;
 
-char ulBuf[sizeof(unsigned long)*8+1];
-
-char sPBuf[256];
+char sPBuf[sizeof(sStatusModeNONE)];                // strings sent to the host are copied here, SerialOut prints from flash
 
 unsigned long ulUptimeSecs = 0;
 int uFreeRAM = 0;
 
 unsigned long ulUptimeRate = 1000;
-unsigned long ulUptimeC = 0, ulUptimeP = 0;
 
 unsigned long ulSampleRate = 19;
-unsigned long ulSampleC = 0, ulSampleP = 0;
+unsigned long ulSampleRateMin = 4, ulSampleRateMax = 250;
+
+unsigned long ulRateActive = ulRateHardware;
+boolean isDebugging = bDebug;                       // false while the main I/O runs above ulRateDebugMax
+unsigned long ulRateProposed = 0;
+unsigned long ulBaudTimeout = 1000;
+unsigned long ulBaudC = 0, ulBaudP = 0;
+
+unsigned long ulLinkRate = 250;
+unsigned long ulLinkC = 0, ulLinkP = 0;
+unsigned long ulLinkBytes = 0, ulLinkCoalesced = 0;
+byte bLinkLoad = 0;
 
 unsigned long ulDSampleRate = 4;
-unsigned long ulDSampleC = 0, ulDSampleP = 0;
 
 unsigned long ulDWriteRate = 250;
-unsigned long ulDWriteC = 0, ulDWriteP = 0;
 
 unsigned long ulDebugRate = 100;
-unsigned long ulDebugC = 0, ulDebugP = 0;
+
+
+unsigned long ulKeypadRate = 1;
+
+// scheduler deadlines (how late a run may start) and budgets (how long a run may take) in uS
+static unsigned int const uInputBudget = 2000;      // host input drained before the outputs are committed
+static unsigned int const uDigitalDeadline = 1000, uDigitalBudget = 3000;
+static unsigned int const uAnalogDeadline = 2000, uAnalogBudget = 1000;
+static unsigned int const uLinkBudget = 500;
+static unsigned int const uDebugDeadline = 50000, uDebugBudget = 3000;
+
+byte bAnalogNext = 0;                               // next channel of a sweep split over several runs
+byte bDebugStep = 0;                                // next part of a debug line split over several runs
+
+boolean isDelta = false;                            // analogue packets are sent as deltas
+byte bDeltaCount = 0;                               // sweeps since the last keyframe, 0 = next one is a keyframe
+int aDeltaPrevious[TOTAL_ANALOG_PINS];              // the sweep the host holds
+
+unsigned int uSnapshotSequence = 0;                 // counts SNAPSHOT_DATA replies, 14 bits on the wire
+unsigned long ulPackBits;                           // bits of a packed reply not yet written
+byte bPackCount;
+
+byte bReplyCommand;                                 // CAPABILITY_RESPONSE or ANALOG_MAPPING_RESPONSE being sent
+byte bReplyStep = 4;                                // 0 START_SYSEX, 1 command, 2 pins, 3 END_SYSEX, 4 idle
+byte bReplyPin;                                     // next pin of the reply
+byte bReplyOffset;                                  // next byte of its capability entry
+
+// rate classes addressed by RATE_DATA, in this order, append new classes at the end to keep EEPROM compatible
+unsigned long * const aRates[] = {&ulSampleRate, &ulDSampleRate, &ulUptimeRate, &ulDebugRate, &ulKeypadRate, &ulSampleRateMin, &ulSampleRateMax};
+static byte const bRateClasses = sizeof(aRates) / sizeof(aRates[0]);
+// shortest interval of each class in mS, 0 would run a task on every pass of loop() and starve the rest
+static unsigned int const aRatesMin[] PROGMEM = {1, 1, 100, 50, 1, 1, 1};
 
 
 class Printer : public Print{
@@ -130,10 +259,16 @@ public:
 Printer PrintDebug;
 
 char* pmstr(const char* str){
-    strcpy_P(sPBuf, (char*)str);
+    strncpy_P(sPBuf, (char*)str, sizeof(sPBuf) - 1);
+    sPBuf[sizeof(sPBuf) - 1] = 0;
     return sPBuf;
 }
 
+static inline const __FlashStringHelper *pmflash(const char *str)
+{
+    return (const __FlashStringHelper *)str;
+}
+
 static inline unsigned char readPort(byte, byte) __attribute__((always_inline, unused));
 static inline unsigned char readPort(byte port, byte bitmask)
 {
@@ -273,82 +408,116 @@ void outputPort(byte portNumber, byte portValue, byte forceSend)
 }
 
 
+// reads one port for the rules and reports it if the host asked for it
+static inline void checkPort(byte port, byte *pins)
+{
+    pins[port] = readPort(port, portConfigInputs[port]);
+    if (reportPINs[port]) outputPort(port, pins[port], false);
+}
+
+
 void checkDigitalInputs(void)
 {
+    byte pins[TOTAL_PORTS];                                 // rules see every input, reported or not
     
-    size_t uLen = 0;
+    if (TOTAL_PORTS > 0 && (bRules || reportPINs[0])) checkPort(0, pins);  
+    if (TOTAL_PORTS > 1 && (bRules || reportPINs[1])) checkPort(1, pins);
+    if (TOTAL_PORTS > 2 && (bRules || reportPINs[2])) checkPort(2, pins);
+    if (TOTAL_PORTS > 3 && (bRules || reportPINs[3])) checkPort(3, pins);
+    if (TOTAL_PORTS > 4 && (bRules || reportPINs[4])) checkPort(4, pins);
+    if (TOTAL_PORTS > 5 && (bRules || reportPINs[5])) checkPort(5, pins);
+    if (TOTAL_PORTS > 6 && (bRules || reportPINs[6])) checkPort(6, pins);
+    if (TOTAL_PORTS > 7 && (bRules || reportPINs[7])) checkPort(7, pins);
+    if (TOTAL_PORTS > 8 && (bRules || reportPINs[8])) checkPort(8, pins);
+    if (TOTAL_PORTS > 9 && (bRules || reportPINs[9])) checkPort(9, pins);
+    if (TOTAL_PORTS > 10 && (bRules || reportPINs[10])) checkPort(10, pins);
+    if (TOTAL_PORTS > 11 && (bRules || reportPINs[11])) checkPort(11, pins);
+    if (TOTAL_PORTS > 12 && (bRules || reportPINs[12])) checkPort(12, pins);
+    if (TOTAL_PORTS > 13 && (bRules || reportPINs[13])) checkPort(13, pins);
+    if (TOTAL_PORTS > 14 && (bRules || reportPINs[14])) checkPort(14, pins);
+    if (TOTAL_PORTS > 15 && (bRules || reportPINs[15])) checkPort(15, pins);
+
+    if (bRules) Rules.evaluate(RULE_SOURCE_DIGITAL, aAnalogRead, pins);
+}
+
+
+// firmata port from the input words of a sample frame, 0 for pins that are not mux inputs
+static inline unsigned char framePort(const sampleFrame *frame, byte port)
+{
+    byte mux = PIN_TO_MUX(port * 8);
     
-    if (TOTAL_PORTS > 0 && reportPINs[0]) outputPort(0, readPort(0, portConfigInputs[0]), false);  
-    if (TOTAL_PORTS > 1 && reportPINs[1]) outputPort(1, readPort(1, portConfigInputs[1]), false);
-    if (TOTAL_PORTS > 2 && reportPINs[2]) outputPort(2, readPort(2, portConfigInputs[2]), false);
-    if (TOTAL_PORTS > 3 && reportPINs[3]) outputPort(3, readPort(3, portConfigInputs[3]), false);
-    if (TOTAL_PORTS > 4 && reportPINs[4]) outputPort(4, readPort(4, portConfigInputs[4]), false);
-    if (TOTAL_PORTS > 5 && reportPINs[5]) outputPort(5, readPort(5, portConfigInputs[5]), false);
-    if (TOTAL_PORTS > 6 && reportPINs[6]) outputPort(6, readPort(6, portConfigInputs[6]), false);
-    if (TOTAL_PORTS > 7 && reportPINs[7]) outputPort(7, readPort(7, portConfigInputs[7]), false);
-    if (TOTAL_PORTS > 8 && reportPINs[8]) outputPort(8, readPort(8, portConfigInputs[8]), false);
-    if (TOTAL_PORTS > 9 && reportPINs[9]) outputPort(9, readPort(9, portConfigInputs[9]), false);
-    if (TOTAL_PORTS > 10 && reportPINs[10]) outputPort(10, readPort(10, portConfigInputs[10]), false);
-    if (TOTAL_PORTS > 11 && reportPINs[11]) outputPort(11, readPort(11, portConfigInputs[11]), false);
-    if (TOTAL_PORTS > 12 && reportPINs[12]) outputPort(12, readPort(12, portConfigInputs[12]), false);
-    if (TOTAL_PORTS > 13 && reportPINs[13]) outputPort(13, readPort(13, portConfigInputs[13]), false);
-    if (TOTAL_PORTS > 14 && reportPINs[14]) outputPort(14, readPort(14, portConfigInputs[14]), false);
-    if (TOTAL_PORTS > 15 && reportPINs[15]) outputPort(15, readPort(15, portConfigInputs[15]), false);
-
-    if(bDebug){
-        ulDebugC = millis();
-        if (ulDebugC - ulDebugP > ulDebugRate){
-            ulDebugP = ulDebugC;
-            
-            SerialOut.print(pmstr(s16spaces));
-            SerialOut.print(pmstr(sStatusRead));
-                        
-            for(int uPort = TOTAL_PORTS-1; uPort >=0; uPort--){
-                if (uPort % 2 > 0) SerialOut.print(pmstr(sStatusDel));
-                
-                if(reportPINs[uPort]){                  // digital in
-                    
-                    uLen= PrintDebug.print(previousPINs[uPort], BIN);
-                    if(uLen==1) SerialOut.print(pmstr(s7bits));
-                    if(uLen==2) SerialOut.print(pmstr(s6bits));
-                    if(uLen==3) SerialOut.print(pmstr(s5bits));
-                    if(uLen==4) SerialOut.print(pmstr(s4bits));
-                    if(uLen==5) SerialOut.print(pmstr(s3bits));
-                    if(uLen==6) SerialOut.print(pmstr(s2bits));
-                    if(uLen==7) SerialOut.print(pmstr(s1bits)); 
-                    
-                    SerialOut.print(previousPINs[uPort], BIN);
-                }
-                
-                else if (portConfigInputs[uPort]){      // analogue in
-                }
-                
-                else {                                  // digital out
-                    if (uPort % 2 > 0) SerialOut.print(pmstr(s16spaces));                    
-                }
-            }
-                       
-            for(int pin = TOTAL_ANALOG_PINS-1; pin >=0; pin--){
-                        
-                uLen= PrintDebug.print(aAnalogRead[pin], HEX);
-                if(uLen==1) SerialOut.print(pmstr(s2bits));
-                if(uLen==2) SerialOut.print(pmstr(s1bits));
+    if (!(MUX_IN_PORT_MASK & (1 << (mux-1)))) return 0;
+    return (frame->digital[mux-1] >> (PIN_TO_MUX_CHANNEL(port * 8))) & portConfigInputs[port];
+}
 
-                SerialOut.print(aAnalogRead[pin], HEX);
-                if(pin > 0) SerialOut.print(pmstr(sStatusDel2));
-            }
-            
-            SerialOut.print(pmstr(sStatusDel));
+// binary mode: the input words of every mux input port
+void sendDigitalPacket(const unsigned int *words)
+{
+    byte payload[2 * PORTS], length = 0;
+    
+    for (byte mux = 1; mux <= PORTS; mux++){
+        if (!(MUX_IN_PORT_MASK & (1 << (mux-1)))) continue;
+        payload[length++] = words[mux-1] & 0xFF;
+        payload[length++] = words[mux-1] >> 8;
+    }
+    Firmata.sendPacket(MUX_FRAME_DIGITAL, payload, length);
+}
 
-            SerialOut.print(pmstr(sStatusUptime));
-            SerialOut.print(ulUptimeSecs);
 
-            SerialOut.print(pmstr(sStatusDel));        
-            SerialOut.print(pmstr(sStatusMem));    
-            SerialOut.print(uFreeRAM);
-            SerialOut.write(13);
+// binary mode: the whole sweep in one packet, 10 bits per channel, or with DELTA_DATA on the
+// change from the sweep before. A keyframe goes out every bDeltaKeyframe sweeps and after a
+// delta could not be queued, so a host that lost one is never more than that far from a resync
+void sendAnalogPacket(const int *values)
+{
+    byte payload[MUX_DELTA_BYTES(TOTAL_ANALOG_PINS)];
+    byte length;
+    
+    if (isDelta && bDeltaCount){
+        length = muxPackDelta(values, aDeltaPrevious, TOTAL_ANALOG_PINS, payload);
+        if (!Firmata.sendPacket(MUX_FRAME_ANALOG_DELTA, payload, length)) bDeltaCount = 0;
+        else if (++bDeltaCount >= bDeltaKeyframe) bDeltaCount = 0;
+        return;
+    }
+    
+    for (byte pin = 0; pin < TOTAL_ANALOG_PINS; pin++) aDeltaPrevious[pin] = values[pin];
+    length = muxPackAnalog(values, TOTAL_ANALOG_PINS, payload);
+    if (Firmata.sendPacket(MUX_FRAME_ANALOG, payload, length) && isDelta) bDeltaCount = 1;
+}
+
+
+// same as checkDigitalInputs() for the frames queued by the digital sample clock, oldest first.
+// Changes are sent per pin and flushed once per run, a port whose pins change in different
+// frames goes out as one message unless one of its pins changes twice.
+boolean checkDigitalFrames(void)
+{
+    const sampleFrame *frame;
+    byte port, value, changed, bit, pins[TOTAL_PORTS];
+    boolean more = false, framed = Firmata.isFramed(), send = false;
+    
+    while ((frame = Sampler.frames.front()) != 0){
+        for (port = 0; port < TOTAL_PORTS; port++){
+            value = framePort(frame, port);
+            pins[port] = value;
+            if (!reportPINs[port]) continue;
+            changed = value ^ previousPINs[port];
+            if (framed) send |= changed != 0;
+            for (bit = 0; changed && !framed; bit++, changed >>= 1){
+                if (changed & 1) Firmata.sendDigital(port * 8 + bit, (value >> bit) & 1);
+            }
+            previousPINs[port] = value;
+        }
+        if (send) sendDigitalPacket(frame->digital);
+        send = false;
+        Sampler.frames.release();
+        
+        if (bRules) Rules.evaluate(RULE_SOURCE_DIGITAL, aAnalogRead, pins);
+        if (Scheduler.expired()){
+            more = Sampler.frames.count() > 0;
+            break;
         }
     }
+    Firmata.flushDigital();
+    return more;
 }
 
 
@@ -377,7 +546,18 @@ void reportDigitalCallback(byte port, int value)
 void setPinModeCallback(byte pin, int mode)
 {   
     
+    if (pin >= TOTAL_PINS) return;                  // the host can address pins up to 127
     if (Firmata.getPinMode(pin) == PIN_MODE_IGNORE) return;
+    
+    if (((mode == OUTPUT || mode == PIN_MODE_PWM) && !IS_PIN_DIGITAL_OUT(pin)) ||
+        ((mode == INPUT || mode == PIN_MODE_PULLUP) && IS_PIN_DIGITAL_OUT(pin))) {
+        Firmata.sendString(pmstr(sStatusModeNONE));                     // port direction is fixed by the hardware
+        return;
+    }
+    
+    if (bSoftPWM && Firmata.getPinMode(pin) == PIN_MODE_PWM && mode != PIN_MODE_PWM) {
+        Pwm.disable(PIN_TO_MUX(pin), PIN_TO_PWM(pin));
+    }
 
     if (IS_PIN_DIGITAL(pin)) {
         if (mode == INPUT || mode == PIN_MODE_PULLUP) {
@@ -416,6 +596,13 @@ void setPinModeCallback(byte pin, int mode)
         }
         break;        
 
+        case PIN_MODE_PWM:
+        if (bSoftPWM && IS_PIN_PWM(pin)) {
+            Firmata.setPinMode(pin, PIN_MODE_PWM);
+            Pwm.setDuty(PIN_TO_MUX(pin), PIN_TO_PWM(pin), 0);
+        }
+        break;
+
         default:
             Firmata.sendString(pmstr(sStatusModeNONE));        
     }
@@ -443,6 +630,18 @@ void setPinValueCallback(byte pin, int value)
 }
 
 
+void analogWriteCallback(byte pin, int value)
+{
+    if (pin < TOTAL_PINS && IS_PIN_PWM(pin) && Firmata.getPinMode(pin) == PIN_MODE_PWM) {
+        if (value > 255) value = 255;
+        if (value < 0) value = 0;
+        
+        Firmata.setPinState(pin, value);
+        Pwm.setDuty(PIN_TO_MUX(pin), PIN_TO_PWM(pin), value);
+    }
+}
+
+
 void digitalWriteCallback(byte port, int value)
 {
   byte pin, lastPin, pinValue, mask = 1, pinWriteMask = 0;
@@ -471,18 +670,731 @@ void digitalWriteCallback(byte port, int value)
 }
 
 
+#if MUX_KEYPAD
+void keypadCallback(byte row, byte col, byte pressed)
+{
+    Firmata.startSysex();
+    Firmata.write(KEYPAD_DATA);
+    Firmata.write(pressed ? bKeypadPress : bKeypadRelease);
+    Firmata.write(row);
+    Firmata.write(col);
+    Firmata.endSysex();
+}
+#endif
+
+
+unsigned long sysexTime(byte *argv)
+{
+    return (unsigned long)argv[0] | ((unsigned long)argv[1] << 7) | ((unsigned long)argv[2] << 14);
+}
+
+
+// PULSE_DATA: pin, units (bit 0 set = uS, else mS), on time (3 x 7 bits), off time (3 x 7 bits), count (0 = cancel, 127 = forever)
+void pulseCallback(byte argc, byte *argv)
+{
+    byte pin = argv[0];
+    unsigned long onTicks, offTicks;
+    
+    if (pin < TOTAL_PINS && IS_PIN_DIGITAL_OUT(pin) && Firmata.getPinMode(pin) == OUTPUT) {
+        if (argv[1] & bPulseMicros) {
+            onTicks = MuxTimer::usToTicks(sysexTime(argv + 2));
+            offTicks = MuxTimer::usToTicks(sysexTime(argv + 5));
+        }
+        else {
+            onTicks = MuxTimer::msToTicks(sysexTime(argv + 2));
+            offTicks = MuxTimer::msToTicks(sysexTime(argv + 5));
+        }
+        Pulse.start(PIN_TO_MUX(pin), PIN_TO_MUX_CHANNEL(pin), onTicks, offTicks, argv[8]);
+    }
+}
+
+
+// set the whole steps in argv from *index on, returns the bytes used
+byte setSequencerSteps(byte *index, byte argc, byte *argv)
+{
+    unsigned int words[TOTAL_MUX_OUT_PORTS];
+    byte const bStepLen = 3 * (1 + TOTAL_MUX_OUT_PORTS);
+    byte port, i;
+    
+    for (i = 0; i + bStepLen <= argc; i += bStepLen) {
+        for (port = 0; port < TOTAL_MUX_OUT_PORTS; port++) words[port] = sysexTime(argv + i + 3 + 3 * port);
+        if (!Sequencer.setStep((*index)++, sysexTime(argv + i), words)) return argc;      // past the end, drop the rest
+    }
+    return i;
+}
+
+
+// SEQUENCER_DATA: CLEAR | STEPS index {duration mS, word per output port}... (3 x 7 bits each) | PLAY mode | STOP | SAVE boot mode | LOAD
+void sequencerCallback(byte argc, byte *argv)
+{
+    byte index;
+    
+    switch (argv[0]) {
+        case bSeqClear:
+        Sequencer.clear();
+        break;
+        
+        case bSeqSteps:
+        if (argc < 2) break;
+        index = argv[1];
+        setSequencerSteps(&index, argc - 2, argv + 2);
+        break;
+        
+        case bSeqPlay:
+        Sequencer.play(argc > 1 ? argv[1] : SEQ_ONCE);
+        break;
+        
+        case bSeqStop:
+        Sequencer.stop();
+        break;
+        
+        case bSeqSave:
+        Sequencer.save(argc > 1 ? argv[1] : SEQ_NONE);
+        break;
+        
+        case bSeqLoad:
+        Sequencer.load();
+        break;
+    }
+}
+
+
+// SEQUENCER_DATA stream handler: a STEPS message longer than the sysex buffer sets its steps as they arrive
+byte sequencerStream(byte command, byte event, byte argc, byte *argv)
+{
+    static boolean bUploading = false;              // a long STEPS message is being received
+    static byte index;                              // its next step
+    byte used = 0;
+    
+    if (event == FIRMATA_STREAM_ABORT){
+        bUploading = false;
+        return 0;
+    }
+    
+    if (!bUploading){
+        if (event == FIRMATA_STREAM_END){           // short message, handled whole
+            if (argc >= 1) sequencerCallback(argc, argv);
+            return argc;
+        }
+        if (argv[0] != bSeqSteps) return 0;         // only STEPS grows this long, the rest is dropped as an overflow
+        index = argv[1];
+        used = 2;
+        bUploading = true;
+    }
+    
+    used += setSequencerSteps(&index, argc - used, argv + used);
+    if (event == FIRMATA_STREAM_END) bUploading = false;
+    return used;
+}
+
+
+void ruleCallback(byte rule, byte pin, byte value)
+{
+    if (value == RULE_VALUE_TOGGLE) value = !Firmata.getPinState(pin);
+    
+    setPinValueCallback(pin, value);
+    
+    Firmata.startSysex();
+    Firmata.write(RULE_DATA);
+    Firmata.write(bRuleFired);
+    Firmata.write(rule);
+    Firmata.write(value);
+    Firmata.endSysex();
+}
+
+
+void sendSysexTime(unsigned long value)
+{
+    Firmata.write(value & 0x7F);
+    Firmata.write((value >> 7) & 0x7F);
+    Firmata.write((value >> 14) & 0x7F);
+}
+
+
+void sendLinkStatus()
+{
+    Firmata.startSysex();
+    Firmata.write(LINK_DATA);
+    Firmata.write(bLinkStatus);
+    sendSysexTime(ulSampleRate);
+    sendSysexTime(ulSampleRateMin);
+    sendSysexTime(ulSampleRateMax);
+    Firmata.write(bLinkLoad);
+    sendSysexTime(Firmata.getDeferredFrames());
+    sendSysexTime(Firmata.getDroppedFrames());
+    sendSysexTime(Firmata.getCoalescedAnalog());
+#if MUX_SERIAL_TRANSPORT
+    sendSysexTime(Uart.rxOverruns);
+    sendSysexTime(Uart.txStalls);
+#endif
+    Firmata.endSysex();
+}
+
+
+// every class to its minimum, and the adaptive sample rate between its bounds
+void clampRates()
+{
+    unsigned long ulMin;
+    
+    for (byte i = 0; i < bRateClasses; i++){
+        ulMin = pgm_read_word(&aRatesMin[i]);
+        if (*aRates[i] < ulMin) *aRates[i] = ulMin;
+    }
+    if (ulSampleRateMax < ulSampleRateMin) ulSampleRateMax = ulSampleRateMin;
+    ulSampleRate = constrain(ulSampleRate, ulSampleRateMin, ulSampleRateMax);
+}
+
+
+// LINK_DATA: QUERY | CONFIG min mS max mS (3 x 7 bits each), min = max fixes the analogue sample rate
+void linkCallback(byte argc, byte *argv)
+{
+    unsigned long ulMin, ulMax;
+    
+    if (argv[0] == bLinkConfig && argc >= 7) {
+        ulMin = sysexTime(argv + 1);
+        ulMax = sysexTime(argv + 4);
+        ulSampleRateMin = ulMin;
+        ulSampleRateMax = ulMax;
+        clampRates();
+    }
+    sendLinkStatus();
+}
+
+
+// measure the bytes actually sent against what the baud rate allows and move the analogue sample
+// interval between its bounds, backing off quickly when the link is full and creeping back slowly
+void adaptSampleRate()
+{
+    unsigned long ulBytes, ulCoalesced, ulCapacity;
+    
+    ulLinkC = millis();
+    if (ulLinkC - ulLinkP < ulLinkRate) return;
+    
+    ulCapacity = ulRateActive / 10 * (ulLinkC - ulLinkP) / 1000;     // 10 bits on the wire per byte
+    ulLinkP = ulLinkC;
+    
+    ulBytes = Firmata.getBytesSent() - ulLinkBytes;
+    ulLinkBytes += ulBytes;
+    ulCoalesced = Firmata.getCoalescedAnalog() - ulLinkCoalesced;
+    ulLinkCoalesced += ulCoalesced;
+    
+    bLinkLoad = (ulBytes >= ulCapacity) ? 100 : ulBytes * 100 / ulCapacity;
+    
+    if (bLinkLoad > bLinkHigh || ulCoalesced){                         // values are being overwritten, the link is full
+        ulSampleRate += ulSampleRate / 4 + 1;
+    }
+    else if (bLinkLoad < bLinkLow && ulSampleRate > ulSampleRateMin){
+        ulSampleRate -= ulSampleRate / 8 + 1;
+    }
+    ulSampleRate = constrain(ulSampleRate, ulSampleRateMin, ulSampleRateMax);
+}
+
+
+void saveRates()
+{
+    eeprom_update_byte((uint8_t *)EEPROM_RATES, 0xFF);
+    eeprom_update_byte((uint8_t *)(EEPROM_RATES + 1), bRateClasses);
+    for (byte i = 0; i < bRateClasses; i++) eeprom_update_dword((uint32_t *)(EEPROM_RATES + 2) + i, *aRates[i]);
+    eeprom_update_byte((uint8_t *)EEPROM_RATES, EEPROM_RATES_MAGIC);
+}
+
+
+boolean loadRates()
+{
+    byte count;
+    
+    if (eeprom_read_byte((const uint8_t *)EEPROM_RATES) != EEPROM_RATES_MAGIC) return false;
+    
+    count = eeprom_read_byte((const uint8_t *)(EEPROM_RATES + 1));
+    if (count > bRateClasses) count = bRateClasses;
+    for (byte i = 0; i < count; i++) *aRates[i] = eeprom_read_dword((const uint32_t *)(EEPROM_RATES + 2) + i);
+    
+    clampRates();                                           // a cleared or foreign image must not stall the loop
+    return true;
+}
+
+
+void sendRates()
+{
+    Firmata.startSysex();
+    Firmata.write(RATE_DATA);
+    Firmata.write(bRateStatus);
+    for (byte i = 0; i < bRateClasses; i++) sendSysexTime(*aRates[i]);
+    Firmata.endSysex();
+}
+
+
+// RATE_DATA: QUERY | SET class mS (3 x 7 bits) | SAVE | LOAD, every command is answered with the current rates
+void rateCallback(byte argc, byte *argv)
+{
+    switch (argv[0]) {
+        case bRateSet:
+        if (argc >= 5 && argv[1] < bRateClasses) {
+            *aRates[argv[1]] = sysexTime(argv + 2);
+            clampRates();
+        }
+        break;
+        
+        case bRateSave:
+        saveRates();
+        break;
+        
+        case bRateLoad:
+        loadRates();
+        break;
+    }
+    sendRates();
+}
+
+
+// SAMPLING_INTERVAL: analogue sweep interval mS (2 x 7 bits), becomes the fastest rate adaptive sampling may use
+void samplingIntervalCallback(byte argc, byte *argv)
+{
+    unsigned long ulRate = argv[0] | (argv[1] << 7);
+    
+    ulSampleRate = ulRate;
+    ulSampleRateMin = ulRate;
+    clampRates();
+}
+
+
+void sendBaud(byte status, unsigned long ulRate)
+{
+    Firmata.startSysex();
+    Firmata.write(BAUD_DATA);
+    Firmata.write(status);
+    sendSysexTime(ulRate);
+    Firmata.endSysex();
+}
+
+
+void setBaud(unsigned long ulRate)
+{
+    Firmata.flushOutput();                                  // everything queued goes out at the old rate
+    if (bDebug){
+        if (isDebugging && ulRate > ulRateDebugMax){
+            SerialOut.println();
+            SerialOut.print(pmflash(sStatusDebugOff));
+            SerialOut.println(ulRate);
+        }
+        isDebugging = (ulRate <= ulRateDebugMax);
+        bDebugStep = 0;                                     // a line cut off here starts again
+    }
+    FIRMATA_SERIAL.begin(ulRate);
+    ulRateActive = ulRate;
+}
+
+
+// fastest rate the UART can receive at without overrun. Its two byte FIFO and the shift register
+// give the receive interrupt two characters, 20 bits, to get in, and it waits behind every
+// interrupt that is pending at the same time: Timer2 and Timer1 both come before it. SerialOut's
+// hold is not counted, setBaud() turns the debug output off above ulRateDebugMax
+unsigned long maxBaud()
+{
+    unsigned int uHoldUs = uIsrTickUs, uPwmTicks;
+    
+    if (bSoftPWM){                                          // a port may be switched to PWM after the rate is set
+        uPwmTicks = PWM_ISR_TICKS + PWM_PORT_TICKS * TOTAL_MUX_OUT_PORTS;
+        if (Pwm.getMaxShiftTicks() > uPwmTicks) uPwmTicks = Pwm.getMaxShiftTicks();
+        uHoldUs += uPwmTicks / 2;
+    }
+    return 20000000UL / uHoldUs;
+}
+
+
+// BAUD_DATA: PROPOSE rate (3 x 7 bits) | PING
+// Rates above maxBaud() are rejected like unknown ones, with PWM on that leaves 115200.
+// The proposal is accepted at the old rate, then the host must PING at the new rate within ulBaudTimeout or
+// the board falls back to ulRateHardware. The host should repeat the PING, the first one may be lost while
+// the UARTs resynchronise.
+void baudCallback(byte argc, byte *argv)
+{
+    unsigned long ulRate;
+    
+    switch (argv[0]) {
+        case bBaudPropose:
+        if (argc < 4) break;
+        ulRate = sysexTime(argv + 1);
+        for (byte i = 0; i < sizeof(aRatesHardware) / sizeof(aRatesHardware[0]); i++) {
+            if (pgm_read_dword(&aRatesHardware[i]) == ulRate && ulRate <= maxBaud()) {
+                sendBaud(bBaudAccept, ulRate);
+                setBaud(ulRate);
+                ulRateProposed = ulRate;
+                ulBaudP = millis();
+                return;
+            }
+        }
+        sendBaud(bBaudReject, ulRate);
+        break;
+        
+        case bBaudPing:
+        ulRateProposed = 0;                                 // the host can hear us, keep the rate
+        sendBaud(bBaudConfirm, ulRateActive);
+        break;
+    }
+}
+
+
+void checkBaud()
+{
+    ulBaudC = millis();
+    if (ulBaudC - ulBaudP >= ulBaudTimeout){
+        ulRateProposed = 0;
+        setBaud(ulRateHardware);
+        sendBaud(bBaudRevert, ulRateHardware);
+    }
+}
+
+
+// signed values go out as 21 bit two's complement, the host sign extends from bit 20
+void sendJitter(byte sampleClass)
+{
+    samplerStats stats;
+    unsigned int uDropped;
+    byte bHighWater;
+    
+    Sampler.getStats(sampleClass, stats);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){                      // the frame sample writes them in the timer interrupt
+        bHighWater = Sampler.frames.highWater;
+        uDropped = Sampler.frames.dropped;
+    }
+    
+    Firmata.startSysex();
+    Firmata.write(JITTER_DATA);
+    Firmata.write(bJitterStatus);
+    Firmata.write(sampleClass);
+    sendSysexTime(stats.period);
+    sendSysexTime(stats.count);
+    sendSysexTime((unsigned long)stats.minJitter);
+    sendSysexTime((unsigned long)stats.maxJitter);
+    sendSysexTime((unsigned long)MuxSampler::getMeanJitter(stats));
+    sendSysexTime(stats.maxLatency);
+    sendSysexTime(Sampler.getMissed(sampleClass));
+    if (sampleClass == SAMPLE_DIGITAL && bSampleFrames){
+        sendSysexTime(bHighWater);
+        sendSysexTime(uDropped);
+    }
+    Firmata.endSysex();
+}
+
+
+// JITTER_DATA: QUERY | RESET, answered with one status per sample class: period, intervals measured,
+// min, max and mean of interval - period, longest wait from due to sample (uS) and missed samples,
+// the digital class adds the most frames queued and frames dropped when it runs on frames
+void jitterCallback(byte argc, byte *argv)
+{
+    if (argv[0] == bJitterReset){
+        Sampler.resetStats();
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+            Sampler.frames.highWater = 0;
+            Sampler.frames.dropped = 0;
+        }
+        Scheduler.resetStats();
+    }
+    for (byte i = 0; i < SAMPLE_CLASSES; i++) sendJitter(i);
+}
+
+
+// BINARY_DATA: ENTER | EXIT | STATUS, answered with STATUS framed (0 = Firmata, 1 = packets) before
+// the switch. Once in, telemetry and every other message go out as MuxFraming packets, input stays
+// Firmata. SYSTEM_RESET also leaves, send END_SYSEX first to close any sysex left half sent.
+void binaryCallback(byte argc, byte *argv)
+{
+    boolean framed = Firmata.isFramed();
+    
+    if (argv[0] == bBinaryEnter) framed = true;
+    else if (argv[0] == bBinaryExit) framed = false;
+    
+    if (!framed && Firmata.isFramed()) Firmata.setFramed(false);
+    Firmata.startSysex();
+    Firmata.write(BINARY_DATA);
+    Firmata.write(bBinaryStatus);
+    Firmata.write(framed);
+    Firmata.endSysex();
+    if (framed && !Firmata.isFramed()){
+        Firmata.setFramed(true);
+        bDeltaCount = 0;                            // start the analogue stream from a keyframe
+    }
+}
+
+
+// DELTA_DATA: OFF | ON | RESYNC, answered with STATUS on/off. RESYNC makes the next sweep a
+// keyframe, a host sends it when a gap in the packet sequence leaves it without a reference
+void deltaCallback(byte argc, byte *argv)
+{
+    if (argv[0] == bDeltaOff) isDelta = false;
+    else if (argv[0] == bDeltaOn) isDelta = true;
+    bDeltaCount = 0;
+    
+    Firmata.startSysex();
+    Firmata.write(DELTA_DATA);
+    Firmata.write(bDeltaStatus);
+    Firmata.write(isDelta);
+    Firmata.endSysex();
+}
+
+
+// append the low bits of value to a packed reply, written 7 bits per sysex byte, LSB first
+void packBits(unsigned int value, byte bits)
+{
+    if (bits < 16) value &= (1u << bits) - 1;
+    ulPackBits |= (unsigned long)value << bPackCount;
+    bPackCount += bits;
+    while (bPackCount >= 7){
+        Firmata.write(ulPackBits & 0x7F);
+        ulPackBits >>= 7;
+        bPackCount -= 7;
+    }
+}
+
+
+// SNAPSHOT_DATA: QUERY, answered with REPLY sequence (2 x 7 bits) and one packed bit stream of
+// the pin modes (4 bits each, 0xF = ignore), the word last written to each output port, the
+// inputs of each input port (16 bits, 1 = input low) and the last analogue sweep (10 bits each)
+void sendSnapshot()
+{
+    unsigned int words[PORTS];
+    const byte *sweep = Sampler.getAnalog();
+    byte pin, mux, mode;
+    
+    Mux.digitalReadPortsMS(words, MUX_IN_PORT_MASK);
+    
+    Firmata.startSysex();
+    Firmata.write(SNAPSHOT_DATA);
+    Firmata.write(bSnapshotReply);
+    Firmata.write(uSnapshotSequence & 0x7F);
+    Firmata.write((uSnapshotSequence >> 7) & 0x7F);
+    uSnapshotSequence++;
+    
+    ulPackBits = 0;
+    bPackCount = 0;
+    for (pin = 0; pin < TOTAL_PINS; pin++){
+        mode = Firmata.getPinMode(pin);
+        packBits(mode == PIN_MODE_IGNORE ? 0xF : mode, 4);
+    }
+    for (mux = 1; mux <= PORTS; mux++){
+        if (MUX_OUT_PORT_MASK & (1 << (mux-1))) packBits(Mux.getPortMS(mux), 16);
+    }
+    for (mux = 1; mux <= PORTS; mux++){
+        if (MUX_IN_PORT_MASK & (1 << (mux-1))) packBits(words[mux-1], 16);
+    }
+    if (bSampleFrames){                             // already packed 10 bits per channel LSB first, the same bit stream
+        for (pin = 0; pin < SAMPLE_ANALOG_BYTES; pin++) packBits(sweep[pin], 8);
+    }
+    else {
+        for (pin = 0; pin < TOTAL_ANALOG_PINS; pin++) packBits(aAnalogRead[pin], 10);
+    }
+    if (bPackCount) packBits(0, 7 - bPackCount);
+    
+    Firmata.endSysex();
+}
+
+
+// RULE_DATA: CLEAR | SET index input condition output action lo hi (2 x 7 bits each) | SAVE | LOAD
+void rulesCallback(byte argc, byte *argv)
+{
+    switch (argv[0]) {
+        case bRuleClear:
+        Rules.clear();
+        break;
+        
+        case bRuleSet:
+        if (argc >= 10) {
+            Rules.setRule(argv[1], argv[2], argv[3], argv[4], argv[5], argv[6] | (argv[7] << 7), argv[8] | (argv[9] << 7));
+        }
+        break;
+        
+        case bRuleSave:
+        Rules.save();
+        break;
+        
+        case bRuleLoad:
+        Rules.load();
+        break;
+    }
+}
+
+
+static const byte *pinCaps(byte pin)
+{
+    if (IS_PIN_ANALOG(pin)) return aCapsAnalog;
+    if (IS_PIN_PWM(pin) && bSoftPWM) return aCapsOutputPwm;
+    if (IS_PIN_DIGITAL_OUT(pin)) return aCapsOutput;
+    if (IS_PIN_DIGITAL_IN_PULLUP(pin)) return aCapsPullup;
+    if (IS_PIN_DIGITAL_IN(pin)) return aCapsInput;
+    return aCapsNone;
+}
+
+
+// reply source for Firmata.sendReply(): the capability or analogue mapping reply is written
+// straight from the tables as the UART has room, nothing per pin is kept in RAM
+byte pinReply(byte *buffer, byte size)
+{
+    byte count = 0, c;
+    
+    while (count < size && bReplyStep < 4){
+        switch (bReplyStep) {
+            case 0:
+            buffer[count++] = START_SYSEX;
+            bReplyStep++;
+            break;
+            
+            case 1:
+            buffer[count++] = bReplyCommand;
+            bReplyStep++;
+            break;
+            
+            case 2:
+            if (bReplyPin >= TOTAL_PINS) {
+                bReplyStep++;
+            }
+            else if (bReplyCommand == ANALOG_MAPPING_RESPONSE) {
+                buffer[count++] = IS_PIN_ANALOG(bReplyPin) ? PIN_TO_ANALOG(bReplyPin) : 127;
+                bReplyPin++;
+            }
+            else {
+                c = pgm_read_byte(pinCaps(bReplyPin) + bReplyOffset++);
+                buffer[count++] = c;
+                if (c == 127) {
+                    bReplyPin++;
+                    bReplyOffset = 0;
+                }
+            }
+            break;
+            
+            case 3:
+            buffer[count++] = END_SYSEX;
+            bReplyStep++;
+            break;
+        }
+    }
+    return count;
+}
+
+
+void startPinReply(byte command)
+{
+    if (bReplyStep < 4) return;                     // one is on its way already, the host gets that
+    
+    bReplyCommand = command;
+    bReplyPin = 0;
+    bReplyOffset = 0;
+    bReplyStep = 0;
+    if (!Firmata.sendReply(pinReply)) bReplyStep = 4;
+}
+
+
+void sendPinState(byte pin)
+{
+    int state = Firmata.getPinState(pin);
+    
+    Firmata.startSysex();
+    Firmata.write(PIN_STATE_RESPONSE);
+    Firmata.write(pin);
+    Firmata.write(Firmata.getPinMode(pin));
+    do {
+        Firmata.write(state & 0x7F);
+        state >>= 7;
+    } while (state > 0);
+    Firmata.endSysex();
+}
+
+
+void sysexCallback(byte command, byte argc, byte *argv)
+{
+    int value;
+    
+    switch (command) {
+        case CAPABILITY_QUERY:
+        startPinReply(CAPABILITY_RESPONSE);
+        break;
+        
+        case ANALOG_MAPPING_QUERY:
+        startPinReply(ANALOG_MAPPING_RESPONSE);
+        break;
+        
+        case PIN_STATE_QUERY:
+        if (argc >= 1 && argv[0] < TOTAL_PINS) sendPinState(argv[0]);
+        break;
+        
+        case EXTENDED_ANALOG:
+        if (argc > 1) {
+            value = argv[1];
+            if (argc > 2) value |= (argv[2] << 7);
+            if (argc > 3) value |= (argv[3] << 14);
+            analogWriteCallback(argv[0], value);
+        }
+        break;
+        
+        case PULSE_DATA:
+        if (bPulse && argc >= 9) pulseCallback(argc, argv);
+        break;
+        
+        case SEQUENCER_DATA:
+        if (bSequencer && argc >= 1) sequencerCallback(argc, argv);
+        break;
+        
+        case RULE_DATA:
+        if (bRules && argc >= 1) rulesCallback(argc, argv);
+        break;
+        
+        case SAMPLING_INTERVAL:
+        if (argc >= 2) samplingIntervalCallback(argc, argv);
+        break;
+        
+        case RATE_DATA:
+        if (argc >= 1) rateCallback(argc, argv);
+        break;
+        
+        case JITTER_DATA:
+        if (bTimedSampling && argc >= 1) jitterCallback(argc, argv);
+        break;
+        
+        case BINARY_DATA:
+        if (argc >= 1) binaryCallback(argc, argv);
+        break;
+        
+        case DELTA_DATA:
+        if (argc >= 1) deltaCallback(argc, argv);
+        break;
+        
+        case SNAPSHOT_DATA:
+        if (argc >= 1 && argv[0] == bSnapshotQuery) sendSnapshot();
+        break;
+        
+        case BAUD_DATA:
+        if (argc >= 1) baudCallback(argc, argv);
+        break;
+        
+        case LINK_DATA:
+        if (argc >= 1) linkCallback(argc, argv);
+        break;
+        
+#if MUX_KEYPAD
+        case KEYPAD_DATA:
+        if (argc >= 4 && argv[0] == bKeypadConfig) {
+            Keypad.configure(argv[1], argv[2], argv[3]);
+        }
+        break;
+#endif
+    }
+}
+
+
 void systemResetCallback()
 {    
     byte bMuxPort = 0;
     
     isResetting = true;
+    Firmata.setFramed(false);                       // SYSTEM_RESET is the way out of binary mode
+    isDelta = false;
     
-    if (bDebug){
-        SerialOut.print(pmstr(s16spaces));
-        SerialOut.println(pmstr(sStatusPorts));
+    if (isDebugging){
+        SerialOut.print(pmflash(s16spaces));
+        SerialOut.println(pmflash(sStatusPorts));
         
-        SerialOut.print(pmstr(s16spaces));
-        SerialOut.print(pmstr(sStatusModes));
+        SerialOut.print(pmflash(s16spaces));
+        SerialOut.print(pmflash(sStatusModes));
     }   
 
     for (byte bPort = TOTAL_PORTS; bPort >=2 ; bPort-=2) {
@@ -494,7 +1406,7 @@ void systemResetCallback()
                 reportPINs[bPort-1] = bPortOn;
                 portConfigInputs[bPort-2] = bPortOn;
                 portConfigInputs[bPort-1] = bPortOn;
-                if (bDebug) SerialOut.print(pmstr(sStatusModeDIN));
+                if (isDebugging) SerialOut.print(pmflash(sStatusModeDIN));
                 break;
                 
             case DIGITAL_OUT:
@@ -502,7 +1414,7 @@ void systemResetCallback()
                 reportPINs[bPort-1] = bPortOff;
                 portConfigInputs[bPort-2] = bPortOff;
                 portConfigInputs[bPort-1] = bPortOff;                
-                if (bDebug) SerialOut.print(pmstr(sStatusModeDOUT));
+                if (isDebugging) SerialOut.print(pmflash(sStatusModeDOUT));
                 break;
                 
             case ANALOG_IN:
@@ -510,7 +1422,7 @@ void systemResetCallback()
                 reportPINs[bPort-1] = bPortOff;
                 portConfigInputs[bPort-2] = bPortOn;
                 portConfigInputs[bPort-1] = bPortOn;
-                if (bDebug) SerialOut.print(pmstr(sStatusModeAIN));
+                if (isDebugging) SerialOut.print(pmflash(sStatusModeAIN));
                 break;
                 
             case DIGITAL_IN_PULLUP:
@@ -518,7 +1430,7 @@ void systemResetCallback()
                 reportPINs[bPort-1] = bPortOn;
                 portConfigInputs[bPort-2] = bPortOn;
                 portConfigInputs[bPort-1] = bPortOn;
-                if (bDebug) SerialOut.print(pmstr(sStatusModeDINP));                
+                if (isDebugging) SerialOut.print(pmflash(sStatusModeDINP));                
                 break;
                 
             default:
@@ -526,14 +1438,14 @@ void systemResetCallback()
                 reportPINs[bPort-1] = bPortOff;
                 portConfigInputs[bPort-2] = bPortOff;
                 portConfigInputs[bPort-1] = bPortOff;
-                if (bDebug) SerialOut.print(pmstr(sStatusModeNONE));
+                if (isDebugging) SerialOut.print(pmflash(sStatusModeNONE));
         }      
 
         previousPINs[bPort-2] = 0;
         previousPINs[bPort-1] = 0;        
     }
     
-    if (bDebug) SerialOut.println(pmstr(sStatusDel2));
+    if (isDebugging) SerialOut.println(pmflash(sStatusDel2));
     
     for (byte i = 0; i < TOTAL_PINS; i++) {
         if (IS_PIN_ANALOG(i)) setPinModeCallback(i, PIN_MODE_ANALOG);
@@ -567,19 +1479,21 @@ void beginFirmata()
     
     Firmata.setFirmwareVersion(FIRMATA_FIRMWARE_MAJOR_VERSION, FIRMATA_FIRMWARE_MINOR_VERSION);
     
+    Firmata.attach(ANALOG_MESSAGE, analogWriteCallback);
     Firmata.attach(DIGITAL_MESSAGE, digitalWriteCallback);
     Firmata.attach(REPORT_ANALOG, reportAnalogCallback);
     Firmata.attach(REPORT_DIGITAL, reportDigitalCallback);    
-    //Firmata.attach(SET_PIN_MODE, setPinModeCallback);
+    Firmata.attach(SET_PIN_MODE, setPinModeCallback);
     
     Firmata.attach(SET_DIGITAL_PIN_VALUE, setPinValueCallback);
-    //Firmata.attach(START_SYSEX, sysexCallback);
+    Firmata.attach(START_SYSEX, sysexCallback);
+    if (bSequencer) Firmata.attachSysexStream(SEQUENCER_DATA, sequencerStream);
     Firmata.attach(SYSTEM_RESET, systemResetCallback);
 
-    Serial.begin(ulRateHardware);    
-    while (!Serial);
+    FIRMATA_SERIAL.begin(ulRateHardware);    
+    while (!FIRMATA_SERIAL);
     
-    Firmata.begin(Serial);   
+    Firmata.begin(FIRMATA_SERIAL);   
     
     systemResetCallback();
     
@@ -609,123 +1523,285 @@ void beginSerialOut()
     SerialOut.write(12);
     SerialOut.write(13);
     
-    for (byte col=0; col <= bDebugLen; col++) SerialOut.print(pmstr(sStatusLine));
+    for (byte col=0; col <= bDebugLen; col++) SerialOut.print(pmflash(sStatusLine));
     SerialOut.println();
     
-    SerialOut.println(pmstr(sStatusSerialUp));    
+    SerialOut.println(pmflash(sStatusSerialUp));    
     
-    SerialOut.print(pmstr(sStatusRateHardware));
+    SerialOut.print(pmflash(sStatusRateHardware));
     SerialOut.println(ulRateHardware);
     
-    SerialOut.print(pmstr(sStatusRateSoftware));    
+    SerialOut.print(pmflash(sStatusRateSoftware));    
     SerialOut.println(ulRateSoftware);
     
-    SerialOut.print(pmstr(sStatusASample));
+    SerialOut.print(pmflash(sStatusASample));
     SerialOut.println(ulSampleRate);
     
-    SerialOut.print(pmstr(sStatusDSample));
+    SerialOut.print(pmflash(sStatusDSample));
     SerialOut.println(ulDSampleRate);
 
-    SerialOut.print(pmstr(sStatusSelfTest));
-    if (bSelfTest) SerialOut.println(pmstr(sStatusOn)); else SerialOut.println(pmstr(sStatusOff));
+    SerialOut.print(pmflash(sStatusSelfTest));
+    if (bSelfTest) SerialOut.println(pmflash(sStatusOn)); else SerialOut.println(pmflash(sStatusOff));
     
-    for (byte col=0; col <= bDebugLen; col++) SerialOut.print(pmstr(sStatusLine));
+    for (byte col=0; col <= bDebugLen; col++) SerialOut.print(pmflash(sStatusLine));
     SerialOut.println();
 }
 
 
-void setup()
-{        
-    if(bDebug) beginSerialOut();
+// the scheduler tasks, added in priority order in beginTasks()
+boolean inputTask()
+{
+    Mux.beginBatchMS();                             // a burst of host writes reaches the outputs with one latch
+    while (!Scheduler.expired() && Firmata.processInputBulk(FIRMATA_RX_CHUNK));
+    Mux.endBatchMS();
     
-    beginMuxShields();
+    return Firmata.available() > 0;
+}
+
+
+boolean digitalTask()
+{
+#if MUX_KEYPAD
+    Keypad.scanRow();
+#else
+    if (bTimedSampling && bUseDigitalRate && bSampleFrames){
+        Sampler.due(SAMPLE_DIGITAL);                // keeps the clock on the current rate, the samples come as frames
+        return checkDigitalFrames();
+    }
+    else if (!(bTimedSampling && bUseDigitalRate) || Sampler.due(SAMPLE_DIGITAL)) checkDigitalInputs();
+#endif
+    return false;
+}
+
+
+boolean analogTask()
+{
+    if (bTimedSampling && bAnalogNext == 0 && !Sampler.due(SAMPLE_ANALOG)) return false;
     
-    beginFirmata();       
+    do {
+        aAnalogRead[bAnalogNext] = Mux.analogReadMS(ANALOG_PORT,bAnalogNext);
+        Firmata.sendAnalog(bAnalogNext, aAnalogRead[bAnalogNext]);
+        bAnalogNext++;
+    } while (bAnalogNext < TOTAL_ANALOG_PINS && !Scheduler.expired());
+    
+    if (bAnalogNext < TOTAL_ANALOG_PINS) return true;
     
+    bAnalogNext = 0;
+    if (Firmata.isFramed()) sendAnalogPacket(aAnalogRead);
+    if (bSampleFrames) Sampler.setAnalog(aAnalogRead);     // frames carry the last complete sweep
+    if (bRules) Rules.evaluate(RULE_SOURCE_ANALOG, aAnalogRead, previousPINs);
+    return false;
 }
 
 
-void loop()
+boolean linkTask()
 {
+    Firmata.processOutput();                        // drain frames the UART had no room for
     
-    if (!(bRunOnce && isOnce)){
-        isOnce = true;
+    if (ulRateProposed) checkBaud();
     
-        
-        if (!isUp){        
-            while (millis() % 1000 != 0);
-            isUp = true;
+    if (bAdaptiveRate) adaptSampleRate();
+    return false;
+}
+
+
+boolean selfTestTask()
+{
+    setPinValueCallback(testPrevious, 0);
+    setPinValueCallback(testCount, 1);
+    
+    testPrevious = testCount;
+    if (testMode){
+        testCount++;
+        if (testCount >= testPort + MUX_PORT_PINS){
+            testCount = testPort + MUX_PORT_PINS -2;
+            testMode = false;  
         }
+    }               
         
-        if (bDebug){            
-            ulUptimeC = millis();    
-            if (ulUptimeC - ulUptimeP >= ulUptimeRate){
-                ulUptimeP = ulUptimeC;
-                ulUptimeSecs = ulUptimeC / 1000;                 
-                uFreeRAM = getFreeRAM();                           
-            }
-        }        
+    else{
+        testCount--;
+        if (testCount <= testPort){
+            testCount = testPort;
+            testMode = true;
+        }
+    }                       
+    return false;
+}
+
+
+boolean uptimeTask()
+{
+    ulUptimeSecs = millis() / 1000;                 
+    uFreeRAM = getFreeRAM();                           
+    return false;
+}
+
+
+// one debug line is written in parts, the software serial blocks for about 0.5mS per character
+boolean debugTask()
+{
+    size_t uLen = 0;
+    int uPort, pin;
+    
+    if (!isDebugging) return false;
+    
+    do {
+        if (bDebugStep == 0){
+            SerialOut.print(pmflash(s16spaces));
+            SerialOut.print(pmflash(sStatusRead));
+        }
         
-        if (bSelfTest){
-            ulDWriteC = millis();
-            if (ulDWriteC - ulDWriteP > ulDWriteRate){
-                ulDWriteP = ulDWriteC;
-                
-                setPinValueCallback(testPrevious, 0);
-                setPinValueCallback(testCount, 1);
+        else if (bDebugStep <= TOTAL_PORTS){
+            uPort = TOTAL_PORTS - bDebugStep;
+            if (uPort % 2 > 0) SerialOut.print(pmflash(sStatusDel));
+            
+            if(reportPINs[uPort]){                  // digital in
                 
-                testPrevious = testCount;
-                if (testMode){
-                    testCount++;
-                    if (testCount >= testPort + MUX_PORT_PINS){
-                        testCount = testPort + MUX_PORT_PINS -2;
-                        testMode = false;  
-                    }
-                }               
-                    
-                else{
-                    testCount--;
-                    if (testCount <= testPort){
-                        testCount = testPort;
-                        testMode = true;
-                    }
-                }                       
+                uLen= PrintDebug.print(previousPINs[uPort], BIN);
+                if(uLen==1) SerialOut.print(pmflash(s7bits));
+                if(uLen==2) SerialOut.print(pmflash(s6bits));
+                if(uLen==3) SerialOut.print(pmflash(s5bits));
+                if(uLen==4) SerialOut.print(pmflash(s4bits));
+                if(uLen==5) SerialOut.print(pmflash(s3bits));
+                if(uLen==6) SerialOut.print(pmflash(s2bits));
+                if(uLen==7) SerialOut.print(pmflash(s1bits)); 
                 
+                SerialOut.print(previousPINs[uPort], BIN);
+            }
+            
+            else if (portConfigInputs[uPort]){      // analogue in
+            }
+            
+            else {                                  // digital out
+                if (uPort % 2 > 0) SerialOut.print(pmflash(s16spaces));                    
             }
         }
-           
-        if (bSampleDigital){
-            if (bUseDigitalRate){
-                ulDSampleC = millis();
-                if (ulDSampleC - ulDSampleP > ulDSampleRate){
-                    ulDSampleP = ulDSampleC;
-                    checkDigitalInputs();             
-                }
+        
+        else if (bDebugStep <= TOTAL_PORTS + TOTAL_ANALOG_PINS){
+            pin = TOTAL_PORTS + TOTAL_ANALOG_PINS - bDebugStep;
+                        
+            uLen= PrintDebug.print(aAnalogRead[pin], HEX);
+            if(uLen==1) SerialOut.print(pmflash(s2bits));
+            if(uLen==2) SerialOut.print(pmflash(s1bits));
+
+            SerialOut.print(aAnalogRead[pin], HEX);
+            if(pin > 0) SerialOut.print(pmflash(sStatusDel2));
+        }
+        
+        else {
+            SerialOut.print(pmflash(sStatusDel));
+
+            SerialOut.print(pmflash(sStatusUptime));
+            SerialOut.print(ulUptimeSecs);
+
+            SerialOut.print(pmflash(sStatusDel));        
+            SerialOut.print(pmflash(sStatusMem));    
+            SerialOut.print(uFreeRAM);
+            
+            SerialOut.print(pmflash(sStatusDel));        
+            SerialOut.print(pmflash(sStatusCycle));    
+            SerialOut.print(Scheduler.maxCycleUs);
+            
+            if (bSoftPWM){                          // shortest plane against the longest PWM interrupt measured
+                SerialOut.print(pmflash(sStatusDel));
+                SerialOut.print(pmflash(sStatusPwm));
+                SerialOut.print(Pwm.getBaseTicks() / 2);
+                SerialOut.print(pmflash(sStatusDel2));
+                SerialOut.print(Pwm.getMaxShiftTicks() / 2);
             }
-            else checkDigitalInputs();                
-        }        
+            SerialOut.write(13);
+            
+            bDebugStep = 0;
+            return false;
+        }
+        
+        bDebugStep++;
+    } while (!Scheduler.expired());
+    
+    return true;
+}
 
-        while (Firmata.available()) Firmata.processInput();    
 
-        if (bSampleAnalog){
-            ulSampleC = millis();
-            if (ulSampleC - ulSampleP > ulSampleRate){
-                ulSampleP = ulSampleC;
-                
-                for (byte pin = 0; pin < TOTAL_ANALOG_PINS; pin++){                    
-                    aAnalogRead[pin] = Mux.analogReadMS(ANALOG_PORT,pin);
-                    Firmata.sendAnalog(pin, aAnalogRead[pin]);
-                    
-                    if (aAnalogRead[1] +1 ==512) setPinValueCallback(1,1); else setPinValueCallback(1,0);
-                    
-                    if (aAnalogRead[3] +1 ==512) setPinValueCallback(3,1); else setPinValueCallback(3,0);
-                    
-                    if (aAnalogRead[6] +1 ==512) setPinValueCallback(6,1); else setPinValueCallback(6,0);
-                    
-                    if (aAnalogRead[6] +1 ==512) setPinValueCallback(11,1); else setPinValueCallback(11,0);
-                }
-            }   
+void beginTasks()
+{
+    Scheduler.add(inputTask, 0, 0, uInputBudget);
+    
+    // with timed sampling the tasks run every pass and wait for the sample clock's due flag
+#if MUX_KEYPAD
+    Scheduler.add(digitalTask, &ulKeypadRate, uDigitalDeadline, uDigitalBudget);
+#else
+    if (bSampleDigital){
+        if (bTimedSampling && bUseDigitalRate){
+            if (bSampleFrames) Sampler.beginFrames(Mux, MUX_IN_PORT_MASK);
+            Sampler.begin(SAMPLE_DIGITAL, &ulDSampleRate);
+            Scheduler.add(digitalTask, 0, 0, uDigitalBudget);
         }
-            
+        else Scheduler.add(digitalTask, bUseDigitalRate ? &ulDSampleRate : 0, uDigitalDeadline, uDigitalBudget);
+    }
+#endif
+    
+    if (bSampleAnalog){
+        if (bTimedSampling){
+            Sampler.begin(SAMPLE_ANALOG, &ulSampleRate);
+            Scheduler.add(analogTask, 0, 0, uAnalogBudget);
+        }
+        else Scheduler.add(analogTask, &ulSampleRate, uAnalogDeadline, uAnalogBudget);
+    }
+    
+    Scheduler.add(linkTask, 0, 0, uLinkBudget);
+    
+    if (bSelfTest) Scheduler.add(selfTestTask, &ulDWriteRate, uDebugDeadline, uDebugBudget);
+    
+    if (bDebug){
+        Scheduler.add(uptimeTask, &ulUptimeRate, uDebugDeadline, uDebugBudget);
+        Scheduler.add(debugTask, &ulDebugRate, uDebugDeadline, uDebugBudget);
+    }
+}
+
+
+void setup()
+{        
+    loadRates();
+    
+    if(bDebug) beginSerialOut();
+    
+    beginMuxShields();
+    
+    if (bSoftPWM) Pwm.begin(Mux);
+    
+    if (bPulse || bSequencer || bTimedSampling) Timers.begin();
+    
+    if (bPulse) Pulse.begin(Mux);
+    
+    if (bSequencer){
+        Sequencer.begin(Mux);
+        Sequencer.load();
+    }
+    
+    if (bRules){
+        Rules.attach(ruleCallback);
+        Rules.load();
+    }
+    
+#if MUX_KEYPAD
+    Keypad.attach(keypadCallback);
+    Keypad.begin(Mux);
+#endif
+    
+    beginFirmata();       
+    
+    beginTasks();
+    
+}
+
+
+void loop()
+{
+    
+    if (!(bRunOnce && isOnce)){
+        isOnce = true;
+        
+        Scheduler.run();
     }
 }
@@ -0,0 +1,288 @@
+/*
+MuxFraming.cpp - COBS framed binary packets with a CRC-16.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * COBS replaces every 0x00 in a packet by the distance to the next one, so 0x00 only ever
+ * appears as the delimiter and a receiver that lost its place resynchronises at the next packet.
+ * The overhead is one byte per 254 plus the delimiter, against one bit in eight for Firmata.
+ * The encoder writes each block's code byte when the block closes, so it needs no look ahead
+ * and no copy of the payload. The CRC is computed bit by bit to keep the table out of flash.
+ * A quiet channel costs 2 bits in a delta sweep against 10 in a keyframe, and noise of one count
+ * costs 4, so a sweep of 16 channels shrinks from 20 bytes to 4 to 8.
+ */
+
+#include "MuxFraming.h"
+
+
+uint16_t muxFrameCrc(uint16_t crc, uint8_t data)
+{
+    crc ^= (uint16_t)data << 8;
+    for (uint8_t bit = 0; bit < 8; bit++){
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+size_t muxPackAnalog(const int *values, uint8_t count, uint8_t *out)
+{
+    uint32_t bits = 0;
+    uint8_t held = 0;
+    size_t length = 0;
+
+    for (uint8_t i = 0; i < count; i++){
+        bits |= (uint32_t)(values[i] & 0x3FF) << held;
+        held += 10;
+        while (held >= 8){
+            out[length++] = bits & 0xFF;
+            bits >>= 8;
+            held -= 8;
+        }
+    }
+    if (held) out[length++] = bits & 0xFF;
+    return length;
+}
+
+void muxUnpackAnalog(const uint8_t *in, uint8_t count, int *values)
+{
+    uint32_t bits = 0;
+    uint8_t held = 0;
+
+    for (uint8_t i = 0; i < count; i++){
+        while (held < 10){
+            bits |= (uint32_t)*in++ << held;
+            held += 8;
+        }
+        values[i] = bits & 0x3FF;
+        bits >>= 10;
+        held -= 10;
+    }
+}
+
+
+size_t muxPackDelta(const int *values, int *previous, uint8_t count, uint8_t *out)
+{
+    uint32_t bits = 0;
+    uint8_t held = 0, size, width;
+    size_t length = 0;
+    int delta;
+    uint16_t zigzag;
+
+    for (uint8_t i = 0; i < count; i++){
+        delta = values[i] - previous[i];
+        previous[i] = values[i];
+        zigzag = (delta < 0) ? ((uint16_t)(-delta) << 1) - 1 : (uint16_t)delta << 1;
+
+        if (zigzag == 0) { size = 0; width = 0; }
+        else if (zigzag < 4) { size = 1; width = 2; }
+        else if (zigzag < 32) { size = 2; width = 5; }
+        else { size = 3; width = 11; }
+
+        bits |= ((uint32_t)size | ((uint32_t)zigzag << 2)) << held;
+        held += 2 + width;
+        while (held >= 8){
+            out[length++] = bits & 0xFF;
+            bits >>= 8;
+            held -= 8;
+        }
+    }
+    if (held) out[length++] = bits & 0xFF;
+    return length;
+}
+
+void muxUnpackDelta(const uint8_t *in, uint8_t count, int *values)
+{
+    static const uint8_t widths[4] = {0, 2, 5, 11};
+    uint32_t bits = 0;
+    uint8_t held = 0, width;
+    uint16_t zigzag;
+
+    for (uint8_t i = 0; i < count; i++){
+        while (held < 2){
+            bits |= (uint32_t)*in++ << held;
+            held += 8;
+        }
+        width = widths[bits & 3];
+        bits >>= 2;
+        held -= 2;
+        while (held < width){
+            bits |= (uint32_t)*in++ << held;
+            held += 8;
+        }
+        zigzag = bits & ((1u << width) - 1);
+        bits >>= width;
+        held -= width;
+
+        values[i] += (zigzag & 1) ? -(int)((zigzag + 1) >> 1) : (int)(zigzag >> 1);
+    }
+}
+
+
+MuxFrameEncoder::MuxFrameEncoder(uint8_t *out, size_t size)
+{
+    _out = out;
+    _size = size;
+    _length = 0;
+    _code = 0;
+    _run = 1;
+    _crc = 0xFFFF;
+    _overflow = false;
+}
+
+void MuxFrameEncoder::begin(uint8_t type, uint8_t sequence)
+{
+    _length = 0;
+    _overflow = false;
+    _crc = 0xFFFF;
+    _code = 0;
+    _run = 1;
+    emit(0);                                            // code byte of the first block, patched later
+
+    put(type);
+    put(sequence);
+}
+
+void MuxFrameEncoder::put(uint8_t data)
+{
+    _crc = muxFrameCrc(_crc, data);
+    encode(data);
+}
+
+size_t MuxFrameEncoder::end(void)
+{
+    uint16_t crc = _crc;
+
+    encode(crc & 0xFF);
+    encode(crc >> 8);
+    if (!_overflow) _out[_code] = _run;
+    emit(0);                                            // delimiter
+
+    return _overflow ? 0 : _length;
+}
+
+void MuxFrameEncoder::encode(uint8_t data)
+{
+    if (data){
+        emit(data);
+        if (++_run < 0xFF) return;                      // a full block of 254 has no implied zero
+    }
+    if (!_overflow) _out[_code] = _run;
+    _code = _length;
+    _run = 1;
+    emit(0);
+}
+
+void MuxFrameEncoder::emit(uint8_t data)
+{
+    if (_length >= _size){
+        _overflow = true;
+        return;
+    }
+    _out[_length++] = data;
+}
+
+
+MuxFrameDecoder::MuxFrameDecoder()
+{
+    crcErrors = 0;
+    framingErrors = 0;
+    lost = 0;
+    _synced = false;
+    _expected = 0;
+    reset();
+}
+
+void MuxFrameDecoder::reset(void)
+{
+    _length = 0;
+    _block = 0;
+    _zero = false;
+    _started = false;
+    _bad = false;
+}
+
+bool MuxFrameDecoder::feed(uint8_t data)
+{
+    uint16_t crc = 0xFFFF;
+    size_t i;
+
+    if (data == 0){                                     // delimiter, the packet is complete
+        bool good = !_bad && _started && _block == 0 && _length >= MUX_FRAME_HEADER + MUX_FRAME_CRC;
+
+        if (!good){
+            if (_started && !_bad) framingErrors++;
+            reset();
+            return false;
+        }
+        for (i = 0; i < _length - MUX_FRAME_CRC; i++) crc = muxFrameCrc(crc, _packet[i]);
+        if ((crc & 0xFF) != _packet[_length - 2] || (crc >> 8) != _packet[_length - 1]){
+            crcErrors++;
+            reset();
+            return false;
+        }
+
+        if (_synced && _packet[1] != _expected) lost += (uint8_t)(_packet[1] - _expected);
+        _expected = _packet[1] + 1;
+        _synced = true;
+
+        _bad = false;
+        _started = false;
+        _block = 0;
+        _zero = false;
+        return true;                                    // _length stays valid until the next byte
+    }
+
+    if (_bad) return false;
+    if (!_started) _length = 0;
+
+    if (!_started || _block == 0){                      // code byte
+        if (_started && _zero) _packet[_length++] = 0;  // the block before ended in a zero
+        _block = data - 1;
+        _zero = data != 0xFF;
+        _started = true;
+    }
+    else {
+        _packet[_length++] = data;
+        _block--;
+    }
+
+    if (_length >= MUX_FRAME_MAX_PACKET){               // longer than any packet we send
+        framingErrors++;
+        _bad = true;
+    }
+    return false;
+}
+
+
+MuxAnalogStream::MuxAnalogStream(uint8_t channels)
+{
+    _channels = channels > 16 ? 16 : channels;
+    _synced = false;
+    _seen = false;
+    _expected = 0;
+    resyncs = 0;
+    for (uint8_t i = 0; i < 16; i++) values[i] = 0;
+}
+
+bool MuxAnalogStream::apply(uint8_t type, uint8_t sequence, const uint8_t *payload, size_t length)
+{
+    if (_seen && sequence != _expected && _synced){       // any packet lost could have been a delta
+        _synced = false;
+        resyncs++;
+    }
+    _seen = true;
+    _expected = sequence + 1;
+
+    if (type == MUX_FRAME_ANALOG && length >= (size_t)(_channels * 10 + 7) / 8){
+        muxUnpackAnalog(payload, _channels, values);
+        _synced = true;
+        return true;
+    }
+    if (type == MUX_FRAME_ANALOG_DELTA && _synced && length > 0){
+        muxUnpackDelta(payload, _channels, values);
+        return true;
+    }
+    return false;
+}
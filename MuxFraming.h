@@ -0,0 +1,113 @@
+/*
+MuxFraming.h - COBS framed binary packets with a CRC-16, the alternative to Firmata's
+7 bit encoding for the telemetry stream.
+A packet is type, sequence, payload and the CRC-16/CCITT (0x1021, start 0xFFFF) of those
+bytes, low byte first, COBS encoded and closed by a 0x00 delimiter. Only plain C++ and
+<stdint.h> are used so the same code builds into a host side decoder.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxFraming_h
+#define MuxFraming_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MUX_FRAME_DIGITAL 0x01          // input word of each mux input port, 16 bits LSB first, 1 = input low
+#define MUX_FRAME_ANALOG 0x02           // one analogue sweep, 10 bits per channel packed LSB first
+#define MUX_FRAME_FIRMATA 0x03          // any other Firmata message, as it would have been sent
+#define MUX_FRAME_ANALOG_DELTA 0x04     // one analogue sweep as the change from the one before, see muxPackDelta()
+
+#define MUX_FRAME_HEADER 2              // type, sequence
+#define MUX_FRAME_CRC 2
+#define MUX_FRAME_MAX_PACKET 136        // decoded bytes the host decoder accepts, header and CRC included
+#define MUX_FRAME_ENCODED(n)            ((n) + MUX_FRAME_HEADER + MUX_FRAME_CRC + ((n) + MUX_FRAME_HEADER + MUX_FRAME_CRC) / 254 + 2)
+
+uint16_t muxFrameCrc(uint16_t crc, uint8_t data);
+
+size_t muxPackAnalog(const int *values, uint8_t count, uint8_t *out);      // returns the bytes written
+void muxUnpackAnalog(const uint8_t *in, uint8_t count, int *values);
+
+// per channel a 2 bit size (0 = no change, 1 = 2 bits, 2 = 5 bits, 3 = 11 bits) then the zigzag
+// encoded change from previous, packed LSB first. previous is updated to values, at most
+// MUX_DELTA_BYTES(count) are written
+#define MUX_DELTA_BYTES(count)          (((count) * 13 + 7) / 8)
+size_t muxPackDelta(const int *values, int *previous, uint8_t count, uint8_t *out);
+void muxUnpackDelta(const uint8_t *in, uint8_t count, int *values);        // values holds the sweep before
+
+// builds one packet into out, COBS is done on the fly by patching each block's code byte
+class MuxFrameEncoder {
+
+public:
+    MuxFrameEncoder(uint8_t *out, size_t size);
+
+    void begin(uint8_t type, uint8_t sequence);
+    void put(uint8_t data);
+    size_t end(void);                           // length with the delimiter, 0 if out was too small
+
+private:
+    uint8_t *_out;
+    size_t _size;
+    size_t _length;
+    size_t _code;                               // index of the code byte of the open block
+    uint8_t _run;                               // its code so far, 1 + data bytes
+    uint16_t _crc;
+    bool _overflow;
+
+    void encode(uint8_t data);
+    void emit(uint8_t data);
+};
+
+// host side: feed it the received bytes, a packet is ready each time feed() returns true
+class MuxFrameDecoder {
+
+public:
+    MuxFrameDecoder();
+
+    bool feed(uint8_t data);
+    void reset(void);
+
+    uint8_t type(void) { return _packet[0]; }
+    uint8_t sequence(void) { return _packet[1]; }
+    const uint8_t *payload(void) { return _packet + MUX_FRAME_HEADER; }
+    size_t length(void) { return _length - MUX_FRAME_HEADER - MUX_FRAME_CRC; }
+
+    unsigned long crcErrors;                    // packets dropped for a bad CRC
+    unsigned long framingErrors;                // packets dropped for bad COBS or length
+    unsigned long lost;                         // packets missing from the sequence
+
+private:
+    uint8_t _packet[MUX_FRAME_MAX_PACKET];
+    size_t _length;                             // decoded bytes of the packet being received
+    uint8_t _block;                             // data bytes left in the current COBS block
+    bool _zero;                                 // the current block ends in a zero
+    bool _started;                              // a code byte has been seen
+    bool _bad;                                  // drop everything up to the next delimiter
+    bool _synced;                               // a packet was received, sequence gaps count as lost
+    uint8_t _expected;                          // next sequence number
+};
+
+// host side: follows the analogue sweeps through keyframes (MUX_FRAME_ANALOG) and deltas,
+// a gap in the packet sequence stops it until the next keyframe arrives
+class MuxAnalogStream {
+
+public:
+    MuxAnalogStream(uint8_t channels);
+
+    bool apply(uint8_t type, uint8_t sequence, const uint8_t *payload, size_t length);    // true when values changed
+    bool synced(void) { return _synced; }       // false: ask for a keyframe
+
+    int values[16];
+    unsigned long resyncs;                      // times a gap broke the stream
+
+private:
+    uint8_t _channels;
+    bool _synced;
+    bool _seen;
+    uint8_t _expected;
+};
+
+#endif
@@ -0,0 +1,142 @@
+/*
+MuxKeypad.cpp - Key matrix scanner for Mayhew Labs' Mux Shield.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * One row is scanned per call to scanRow() so the main loop is never held for a whole matrix.
+ * Each key is debounced with a 2 bit vertical counter: a key changes state only after
+ * the configured number of consecutive samples disagree with its debounced state.
+ * A row with two or more keys down that shares a column with a key down in another row
+ * can not be told apart from a ghost in a matrix without diodes, so it is held unchanged.
+ * The key state takes 6 bytes per row and column port, sized for the matrix set in Boards.h,
+ * and the scanner is only built with MUX_KEYPAD set there.
+ */
+
+#include <Arduino.h>
+
+#include "MuxKeypad.h"
+
+#if MUX_KEYPAD
+
+#if KEYPAD_ROWS < 1 || KEYPAD_ROWS > CHANNELS || KEYPAD_COL_PORTS < 1 || KEYPAD_COL_PORTS > KEYPAD_ROW_PORT - KEYPAD_COL_PORT
+#error MUX_KEYPAD_ROWS must be 1 to 16 and MUX_KEYPAD_COL_PORTS 1 to 4
+#endif
+
+MuxKeypad::MuxKeypad()
+{
+    _mux = 0;
+    _callback = 0;
+    _row = 0;
+    ghostCount = 0;
+    
+    configure(KEYPAD_ROWS, KEYPAD_COL_PORTS, KEYPAD_DEBOUNCE);
+}
+
+void MuxKeypad::begin(MuxShield &mux)
+{
+    _mux = &mux;
+    _mux->digitalWritePortMS(KEYPAD_ROW_PORT, 0xFFFF);            // all rows idle (high)
+}
+
+void MuxKeypad::configure(byte rows, byte colPorts, byte debounce)
+{
+    byte row, port;
+    
+    if (rows > KEYPAD_ROWS) rows = KEYPAD_ROWS;
+    if (colPorts > KEYPAD_COL_PORTS) colPorts = KEYPAD_COL_PORTS;
+    if (debounce < 1) debounce = 1;
+    if (debounce > 4) debounce = 4;
+    
+    _rows = rows;
+    _colPorts = colPorts;
+    _debounce = debounce;
+    _row = 0;
+    
+    for (row = 0; row < KEYPAD_ROWS; row++){
+        for (port = 0; port < KEYPAD_COL_PORTS; port++){
+            _state[row][port] = 0;
+            _cnt0[row][port] = 0;
+            _cnt1[row][port] = 0;
+        }
+    }
+}
+
+void MuxKeypad::attach(keypadCallbackFunction newFunction)
+{
+    _callback = newFunction;
+}
+
+boolean MuxKeypad::isPressed(byte row, byte col)
+{
+    if (row >= _rows || col >= _colPorts * CHANNELS) return false;
+    return (_state[row][col / CHANNELS] >> (col % CHANNELS)) & 1;
+}
+
+boolean MuxKeypad::isGhosted(byte row, unsigned int *raw)
+{
+    byte port, other, keys = 0;
+    unsigned int bits;
+    
+    for (port = 0; port < _colPorts; port++){
+        for (bits = raw[port]; bits; bits &= bits - 1) keys++;
+    }
+    if (keys < 2) return false;
+    
+    for (other = 0; other < _rows; other++){
+        if (other == row) continue;
+        for (port = 0; port < _colPorts; port++){
+            if (raw[port] & _state[other][port]) return true;
+        }
+    }
+    return false;
+}
+
+void MuxKeypad::scanRow(void)
+{
+    unsigned int raw[PORTS];
+    unsigned int diff, ready, eq0, eq1, mask, c0;
+    int muxMask = 0;
+    byte port, bit;
+    
+    if (!_mux || _rows == 0) return;
+    
+    for (port = 0; port < _colPorts; port++) muxMask |= 1 << (KEYPAD_COL_PORT - 1 + port);
+    
+    _mux->digitalWritePortMS(KEYPAD_ROW_PORT, ~(1u << _row));    // strobe row low
+    _mux->digitalReadPortsMS(raw, muxMask);                       // pressed keys read back as 1
+    
+    if (isGhosted(_row, raw + KEYPAD_COL_PORT - 1)) ghostCount++;
+    
+    else {
+        for (port = 0; port < _colPorts; port++){
+            diff = raw[KEYPAD_COL_PORT - 1 + port] ^ _state[_row][port];
+            c0 = _cnt0[_row][port];
+            
+            eq0 = ((_debounce - 1) & 1) ? c0 : ~c0;
+            eq1 = ((_debounce - 1) & 2) ? _cnt1[_row][port] : ~_cnt1[_row][port];
+            ready = diff & eq0 & eq1;                             // disagreed for long enough
+            
+            mask = diff & ~ready;                                 // count up where still disagreeing, clear elsewhere
+            _cnt1[_row][port] = (_cnt1[_row][port] ^ c0) & mask;
+            _cnt0[_row][port] = ~c0 & mask;
+            
+            _state[_row][port] ^= ready;
+            
+            if (ready && _callback){
+                for (bit = 0; bit < CHANNELS; bit++){
+                    if ((ready >> bit) & 1) (*_callback)(_row, port * CHANNELS + bit, (_state[_row][port] >> bit) & 1);
+                }
+            }
+        }
+    }
+    
+    _row++;
+    if (_row >= _rows) _row = 0;
+}
+
+// make one instance for the sketch to use
+MuxKeypad Keypad;
+
+#endif
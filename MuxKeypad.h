@@ -0,0 +1,65 @@
+/*
+MuxKeypad.h - Key matrix scanner for Mayhew Labs' Mux Shield.
+Rows are strobed through the shift registers of one output port,
+columns are read from up to four input ports with the bulk port read.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxKeypad_h
+#define MuxKeypad_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#include "Boards.h"
+#include "MuxShields.h"
+
+#if MUX_KEYPAD
+
+#define KEYPAD_ROWS MUX_KEYPAD_ROWS     // rows the key state is sized for, one per channel of the row port (16 at most)
+#define KEYPAD_COL_PORTS MUX_KEYPAD_COL_PORTS   // column ports the key state is sized for, 16 columns each (4 at most, 16 x 64 keys)
+#define KEYPAD_ROW_PORT 6               // mux port driving the rows (active low)
+#define KEYPAD_COL_PORT 2               // first mux port sensing the columns (pull-up inputs)
+#define KEYPAD_DEBOUNCE 4               // default consecutive samples before a key changes state (1..4)
+
+extern "C" {
+    typedef void (*keypadCallbackFunction)(byte row, byte col, byte pressed);
+}
+
+class MuxKeypad {
+
+public:
+    MuxKeypad();
+
+    void begin(MuxShield &mux);
+    void configure(byte rows, byte colPorts, byte debounce);
+    void attach(keypadCallbackFunction newFunction);
+
+    void scanRow(void);                         // strobe the next row, read its columns and raise events
+    boolean isPressed(byte row, byte col);
+
+    unsigned long ghostCount;                   // number of row samples discarded as ghosted
+
+private:
+    MuxShield *_mux;
+    keypadCallbackFunction _callback;
+
+    byte _rows, _colPorts, _debounce;
+    byte _row;                                  // next row to be strobed
+
+    unsigned int _state[KEYPAD_ROWS][KEYPAD_COL_PORTS];     // debounced key state, bit set = pressed
+    unsigned int _cnt0[KEYPAD_ROWS][KEYPAD_COL_PORTS];      // vertical debounce counter, bit 0
+    unsigned int _cnt1[KEYPAD_ROWS][KEYPAD_COL_PORTS];      // vertical debounce counter, bit 1
+
+    boolean isGhosted(byte row, unsigned int *raw);
+};
+
+extern MuxKeypad Keypad;
+
+#endif
+
+#endif
@@ -0,0 +1,185 @@
+/*
+MuxPWM.cpp - Software PWM for the shift register outputs of Mayhew Labs' Mux Shield.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * Timer1 runs in CTC mode with a /8 prescaler. On every compare match OCR1A is first set to the
+ * weight of the next bit plane, while the counter is still close to 0, and the plane is then
+ * shifted out through MuxShield::refreshPWM(). Every plane is latched the same shift time after
+ * its match, so it is shown for exactly its weight, and a full cycle is 255 base periods with
+ * only 8 interrupts whatever the channel count.
+ * The base period has to be longer than the interrupt or the shortest planes overrun. It starts
+ * from PWM_ISR_TICKS + PWM_PORT_TICKS per port, counted from the generated code at about 20uS
+ * plus 16uS per port, and each interrupt measures itself with TCNT1 and lengthens it if needed.
+ * The frame sample is taken outside the Timer2 interrupt proper, see MuxTimer::later(), so the
+ * plane interrupt is only held off by the short Timer2 tick and the late path stays rare.
+ * The timer is only running while at least one channel is in PWM mode.
+ */
+
+#include <Arduino.h>
+#include <avr/interrupt.h>
+
+#include "MuxPWM.h"
+
+
+MuxPWM::MuxPWM()
+{
+    _mux = 0;
+    _plane = 0;
+    _running = false;
+    _maxShift = 0;
+    
+    for (byte k = 0; k < PWM_PLANES; k++){
+        for (byte i = 0; i < TOTAL_MUX_OUT_PORTS; i++) _planes[k][i] = 0;
+    }
+    for (byte i = 0; i < TOTAL_MUX_OUT_PORTS; i++) _mask[i] = 0;
+    sizePlanes();
+}
+
+void MuxPWM::begin(MuxShield &mux)
+{
+    _mux = &mux;
+}
+
+byte MuxPWM::port(int mux, int chan)
+{
+    if (mux < 1 || mux > PORTS || chan < 0 || chan >= CHANNELS) return 0xFF;
+    if (!(MUX_OUT_PORT_MASK & (1 << (mux-1)))) return 0xFF;
+    return MUX_PORTS_BELOW(mux, MUX_OUT_PORT_MASK);
+}
+
+void MuxPWM::setDuty(int mux, int chan, byte duty)
+{
+    unsigned int bit;
+    byte i = port(mux, chan), k;
+    
+    if (!_mux || i == 0xFF) return;
+    
+    bit = 1u << chan;
+    
+    uint8_t oldSREG = SREG;
+    cli();                                      // planes are read by the interrupt, don't let it see half a duty
+    for (k = 0; k < PWM_PLANES; k++){
+        if ((duty >> k) & 1) _planes[k][i] |= bit;
+        else _planes[k][i] &= ~bit;
+    }
+    SREG = oldSREG;
+    
+    if (!(_mask[i] & bit)){
+        _mask[i] |= bit;
+        _mux->setPWMMask(mux, _mask[i]);
+        sizePlanes();
+    }
+    
+    if (!_running) start();
+}
+
+byte MuxPWM::getDuty(int mux, int chan)
+{
+    byte duty = 0, i = port(mux, chan);
+    
+    if (i == 0xFF) return 0;
+    
+    for (byte k = 0; k < PWM_PLANES; k++){
+        if ((_planes[k][i] >> chan) & 1) duty |= (1 << k);
+    }
+    return duty;
+}
+
+void MuxPWM::disable(int mux, int chan)
+{
+    unsigned int bit;
+    byte i = port(mux, chan), n;
+    boolean any = false;
+    
+    if (!_mux || i == 0xFF) return;
+    
+    bit = 1u << chan;
+    if (!(_mask[i] & bit)) return;
+    
+    _mask[i] &= ~bit;
+    _mux->setPWMMask(mux, _mask[i]);
+    sizePlanes();
+    
+    for (n = 0; n < TOTAL_MUX_OUT_PORTS; n++){
+        if (_mask[n]) any = true;
+    }
+    if (!any) stop();
+    
+    _mux->digitalWritePortMS(mux, _mux->getPortMS(mux));      // show the on/off value again
+}
+
+// the shortest plane has to outlast the interrupt, which grows with each port shifted
+void MuxPWM::sizePlanes(void)
+{
+    unsigned int base = PWM_ISR_TICKS;
+    
+    for (byte i = 0; i < TOTAL_MUX_OUT_PORTS; i++){
+        if (_mask[i]) base += PWM_PORT_TICKS;
+    }
+    if (base < _maxShift + PWM_MARGIN_TICKS) base = _maxShift + PWM_MARGIN_TICKS;
+    if (base > PWM_MAX_BASE_TICKS) base = PWM_MAX_BASE_TICKS;
+    
+    uint8_t oldSREG = SREG;
+    cli();
+    _base = base;
+    SREG = oldSREG;
+}
+
+void MuxPWM::tick(void)
+{
+    byte plane = _plane;
+    unsigned int ocr = (_base << plane) - 1, start, run;
+    boolean late;
+    
+    OCR1A = ocr;                                // the plane shifted out now lasts its weight from the match that started it
+    start = TCNT1;
+    late = start + 2 > ocr;
+    if (late) TCNT1 = ocr - 2;                  // held off past its end, close it now instead of after a wrap of the counter
+    
+    _mux->refreshPWM(_planes[plane], MUX_OUT_PORT_MASK);
+    
+    plane++;
+    if (plane >= PWM_PLANES) plane = 0;
+    _plane = plane;
+    
+    if (late) return;
+    if (TIFR1 & _BV(OCF1A)) run = ocr + 1;      // the plane ended before the shift did
+    else run = TCNT1 - start;
+    if (run > _maxShift){
+        _maxShift = run;
+        if (run + PWM_MARGIN_TICKS > _base){
+            _base = (run + PWM_MARGIN_TICKS < PWM_MAX_BASE_TICKS) ? run + PWM_MARGIN_TICKS : PWM_MAX_BASE_TICKS;
+        }
+    }
+}
+
+void MuxPWM::start(void)
+{
+    uint8_t oldSREG = SREG;
+    cli();
+    _plane = 0;
+    TCCR1A = 0;
+    TCCR1B = _BV(WGM12) | _BV(CS11);            // CTC on OCR1A, clk/8
+    TCNT1 = 0;
+    OCR1A = _base - 1;
+    TIMSK1 |= _BV(OCIE1A);
+    _running = true;
+    SREG = oldSREG;
+}
+
+void MuxPWM::stop(void)
+{
+    TIMSK1 &= ~_BV(OCIE1A);
+    _running = false;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+    Pwm.tick();
+}
+
+// make one instance for the timer interrupt to use
+MuxPWM Pwm;
@@ -0,0 +1,61 @@
+/*
+MuxPWM.h - Software PWM for the shift register outputs of Mayhew Labs' Mux Shield.
+Binary code modulation: each 8 bit duty value is shown as 8 bit planes, plane n
+being held for 2^n base periods, refreshed from the Timer1 compare interrupt.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxPWM_h
+#define MuxPWM_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#include "Boards.h"
+#include "MuxShields.h"
+
+#define PWM_PLANES 8                    // bits of duty resolution
+#define PWM_ISR_TICKS 40                // Timer1 counts (0.5uS each) the interrupt takes besides the shifts
+#define PWM_PORT_TICKS 32               // counts to shift one port out
+#define PWM_MARGIN_TICKS 8              // kept between the longest shift measured and the shortest plane
+#define PWM_MAX_BASE_TICKS 255          // longest shortest plane, the longest plane must fit in OCR1A
+                                        // shortest plane with one port: 72 counts, 255 * 36uS = 109Hz refresh
+
+class MuxPWM {
+
+public:
+    MuxPWM();
+
+    void begin(MuxShield &mux);
+    void setDuty(int mux, int chan, byte duty);
+    byte getDuty(int mux, int chan);
+    void disable(int mux, int chan);            // hand the channel back to its on/off value
+
+    unsigned int getBaseTicks(void) { return _base; }          // Timer1 counts in the shortest plane
+    unsigned int getMaxShiftTicks(void) { return _maxShift; }  // longest interrupt measured, from the OCR1A write
+
+    void tick(void);                            // called from the timer interrupt only
+
+private:
+    MuxShield *_mux;
+
+    unsigned int _planes[PWM_PLANES][TOTAL_MUX_OUT_PORTS];     // bit n of _planes[k][i] = bit k of duty of channel n, i counts output ports from the lowest
+    unsigned int _mask[TOTAL_MUX_OUT_PORTS];    // channels under PWM on each output port
+    byte _plane;                                // plane shown next
+    boolean _running;
+    volatile unsigned int _base;                // counts in the shortest plane, raised if a shift outgrows it
+    volatile unsigned int _maxShift;
+
+    byte port(int mux, int chan);               // index in _planes of an output port, 0xFF if mux is not one
+    void sizePlanes(void);
+    void start(void);
+    void stop(void);
+};
+
+extern MuxPWM Pwm;
+
+#endif
@@ -0,0 +1,122 @@
+/*
+MuxPulse.cpp - Timed pulses on the shift register outputs of Mayhew Labs' Mux Shield.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * A pulse is a small state machine stepped by MuxTimer: the first edge is made one tick after
+ * start(), each following edge onTicks or offTicks after the previous one.
+ */
+
+#include <Arduino.h>
+
+#include "MuxPulse.h"
+
+
+static void pulseTimerCallback(byte id)
+{
+    Pulse.fire(id);
+}
+
+
+MuxPulse::MuxPulse()
+{
+    _mux = 0;
+    for (byte i = 0; i < PULSE_MAX; i++) _pulses[i].mux = 0;
+}
+
+void MuxPulse::begin(MuxShield &mux)
+{
+    _mux = &mux;
+}
+
+byte MuxPulse::find(int mux, int chan)
+{
+    for (byte i = 0; i < PULSE_MAX; i++){
+        if (_pulses[i].mux == mux && _pulses[i].chan == chan) return i;
+    }
+    return PULSE_MAX;
+}
+
+boolean MuxPulse::start(int mux, int chan, unsigned long onTicks, unsigned long offTicks, byte count)
+{
+    byte id;
+    
+    if (!_mux || mux < 1 || mux > PORTS || chan < 0 || chan >= CHANNELS) return false;
+    
+    cancel(mux, chan);
+    if (count == 0) return true;                // a count of 0 only cancels
+    
+    id = find(0, 0);
+    if (id >= PULSE_MAX) return false;
+    
+    _pulses[id].chan = chan;
+    _pulses[id].count = count;
+    _pulses[id].on = false;
+    _pulses[id].onTicks = onTicks ? onTicks : 1;
+    _pulses[id].offTicks = offTicks ? offTicks : 1;
+    
+    uint8_t oldSREG = SREG;
+    cli();
+    _pulses[id].mux = mux;
+    _pulses[id].timer = Timers.schedule(1, pulseTimerCallback, id);
+    if (_pulses[id].timer == TIMER_NONE) _pulses[id].mux = 0;
+    SREG = oldSREG;
+    
+    return _pulses[id].mux != 0;
+}
+
+void MuxPulse::cancel(int mux, int chan)
+{
+    byte id;
+    
+    uint8_t oldSREG = SREG;
+    cli();
+    
+    id = find(mux, chan);
+    if (id < PULSE_MAX){
+        Timers.cancel(_pulses[id].timer);
+        if (_pulses[id].on) _mux->digitalWriteBitsMS(mux, 0, 1u << chan);
+        release(id);
+    }
+    
+    SREG = oldSREG;
+}
+
+boolean MuxPulse::isActive(int mux, int chan)
+{
+    return find(mux, chan) < PULSE_MAX;
+}
+
+void MuxPulse::release(byte id)
+{
+    _pulses[id].mux = 0;
+    _pulses[id].chan = 0;
+}
+
+void MuxPulse::fire(byte id)
+{
+    pulse *p = &_pulses[id];
+    
+    if (!p->on){
+        p->timer = Timers.schedule(p->onTicks, pulseTimerCallback, id);
+        if (p->timer == TIMER_NONE){            // never leave an output on without a timer to clear it
+            release(id);
+            return;
+        }
+        _mux->digitalWriteBitsMS(p->mux, 1u << p->chan, 0);
+        p->on = true;
+    }
+    else {
+        _mux->digitalWriteBitsMS(p->mux, 0, 1u << p->chan);
+        p->on = false;
+        if (p->count != PULSE_FOREVER) p->count--;
+        
+        if (p->count) p->timer = Timers.schedule(p->offTicks, pulseTimerCallback, id);
+        if (!p->count || p->timer == TIMER_NONE) release(id);
+    }
+}
+
+// make one instance for the timer wheel to use
+MuxPulse Pulse;
@@ -0,0 +1,56 @@
+/*
+MuxPulse.h - Timed pulses on the shift register outputs of Mayhew Labs' Mux Shield.
+Every edge is made from the timer wheel interrupt, so pulse widths do not depend on
+the main loop or the serial link.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxPulse_h
+#define MuxPulse_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#include "MuxShields.h"
+#include "MuxTimer.h"
+
+#define PULSE_MAX 4                     // channels pulsing at once, 14 bytes of RAM each: one per relay or solenoid
+                                        // driven together, a start with none free is ignored. TIMER_MAX grows with it
+#define PULSE_FOREVER 127               // pulse count meaning repeat until cancelled
+
+class MuxPulse {
+
+public:
+    MuxPulse();
+
+    void begin(MuxShield &mux);
+    boolean start(int mux, int chan, unsigned long onTicks, unsigned long offTicks, byte count);
+    void cancel(int mux, int chan);
+    boolean isActive(int mux, int chan);
+
+    void fire(byte id);                         // called from the timer wheel only
+
+private:
+    struct pulse {
+        byte mux;                               // 0 when unused
+        byte chan;
+        byte count;                             // pulses left, including the one in progress
+        boolean on;
+        byte timer;
+        unsigned long onTicks, offTicks;
+    };
+
+    MuxShield *_mux;
+    pulse _pulses[PULSE_MAX];
+
+    byte find(int mux, int chan);
+    void release(byte id);
+};
+
+extern MuxPulse Pulse;
+
+#endif
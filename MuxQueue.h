@@ -0,0 +1,71 @@
+/*
+MuxQueue.h - Lock-free single producer, single consumer queue of fixed size items.
+One side may be an interrupt: each index is a byte written by one side only, so
+AVR reads and writes it atomically and neither side ever has to turn interrupts off.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxQueue_h
+#define MuxQueue_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+// SIZE must be a power of 2 no larger than 128, the indices run free and wrap at 256
+template <typename T, byte SIZE>
+class MuxQueue {
+
+public:
+    MuxQueue() : highWater(0), dropped(0), _head(0), _tail(0) {}
+
+    // producer: the item to fill in place, 0 when the queue is full (counted in dropped)
+    T *claim(void)
+    {
+        if ((byte)(_head - _tail) >= SIZE){
+            dropped++;
+            return 0;
+        }
+        return &_items[_head & (SIZE - 1)];
+    }
+
+    // producer: hand the claimed item to the consumer
+    void publish(void)
+    {
+        byte count;
+
+        __asm__ __volatile__ ("" ::: "memory");             // the item is complete before the index moves
+        _head = _head + 1;
+        count = _head - _tail;
+        if (count > highWater) highWater = count;
+    }
+
+    // consumer: the oldest item, 0 when the queue is empty
+    const T *front(void)
+    {
+        if (_head == _tail) return 0;
+        return &_items[_tail & (SIZE - 1)];
+    }
+
+    // consumer: give the oldest item back to the producer
+    void release(void)
+    {
+        __asm__ __volatile__ ("" ::: "memory");             // finished with the item before the index moves
+        _tail = _tail + 1;
+    }
+
+    byte count(void) { return _head - _tail; }
+
+    volatile byte highWater;                    // most items queued at once, written by the producer
+    volatile unsigned int dropped;              // items the producer could not queue, read it with interrupts off
+
+private:
+    volatile byte _head;                        // written by the producer only
+    volatile byte _tail;                        // written by the consumer only
+    T _items[SIZE];
+};
+
+#endif
@@ -0,0 +1,130 @@
+/*
+MuxRules.cpp - Threshold rule engine for MuxFirmata.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * EEPROM layout at EEPROM_RULES: magic, then the RULE_MAX rules as stored in RAM. Rules are
+ * checked again when loaded, an image from another build or a worn cell only loses those rules.
+ */
+
+#include <Arduino.h>
+
+#include "MuxRules.h"
+#include "MuxEEPROM.h"
+
+
+MuxRules::MuxRules()
+{
+    _callback = 0;
+    clear();
+}
+
+void MuxRules::clear(void)
+{
+    for (byte i = 0; i < RULE_MAX; i++) _rules[i].input = RULE_UNUSED;
+    _level = 0;
+    _valid = 0;
+}
+
+boolean MuxRules::setRule(byte index, byte input, byte condition, byte output, byte action, unsigned int lo, unsigned int hi)
+{
+    if (index >= RULE_MAX || !valid(input, condition, output, action)) return false;
+    
+    _rules[index].input = input;
+    _rules[index].condition = condition;
+    _rules[index].output = output;
+    _rules[index].action = action;
+    _rules[index].lo = lo;
+    _rules[index].hi = hi;
+    
+    _valid &= ~(1u << index);
+    return true;
+}
+
+boolean MuxRules::valid(byte input, byte condition, byte output, byte action)
+{
+    if (input == RULE_UNUSED) return true;
+    return input < TOTAL_PINS && condition <= RULE_FALLING && output < TOTAL_PINS && action <= RULE_TOGGLE;
+}
+
+void MuxRules::attach(ruleCallbackFunction newFunction)
+{
+    _callback = newFunction;
+}
+
+void MuxRules::evaluate(byte source, const int *analog, const byte *ports)
+{
+    rule *r;
+    unsigned int bit, value;
+    boolean level, was, trigger;
+    
+    if (!_callback) return;
+    
+    for (byte i = 0; i < RULE_MAX; i++){
+        r = &_rules[i];
+        if (r->input == RULE_UNUSED) continue;
+        if (IS_PIN_ANALOG(r->input) != (source == RULE_SOURCE_ANALOG)) continue;
+        
+        if (source == RULE_SOURCE_ANALOG) value = analog[PIN_TO_ANALOG(r->input)];
+        else value = (ports[r->input / 8] >> (r->input & 7)) & 1;
+        
+        bit = 1u << i;
+        was = (_level & bit) != 0;
+        
+        switch (r->condition){
+            case RULE_ABOVE:        level = value > r->hi; break;
+            case RULE_BELOW:        level = value < r->lo; break;
+            case RULE_INSIDE:       level = value >= r->lo && value <= r->hi; break;
+            case RULE_OUTSIDE:      level = value < r->lo || value > r->hi; break;
+            case RULE_HYSTERESIS:   level = value > r->hi ? true : (value < r->lo ? false : was); break;
+            default:                level = value > r->lo; break;             // RULE_RISING, RULE_FALLING
+        }
+        
+        if (level) _level |= bit; else _level &= ~bit;
+        
+        if (!(_valid & bit)){                   // first look: outputs that follow are brought into line, nothing triggers
+            _valid |= bit;
+            if (r->action == RULE_FOLLOW) (*_callback)(i, r->output, level);
+            if (r->action == RULE_INVERT) (*_callback)(i, r->output, !level);
+            continue;
+        }
+        
+        if (level == was) continue;
+        
+        trigger = (r->condition == RULE_FALLING) ? !level : level;
+        
+        switch (r->action){
+            case RULE_FOLLOW:   (*_callback)(i, r->output, level); break;
+            case RULE_INVERT:   (*_callback)(i, r->output, !level); break;
+            case RULE_SET:      if (trigger) (*_callback)(i, r->output, 1); break;
+            case RULE_CLEAR:    if (trigger) (*_callback)(i, r->output, 0); break;
+            case RULE_TOGGLE:   if (trigger) (*_callback)(i, r->output, RULE_VALUE_TOGGLE); break;
+        }
+    }
+}
+
+void MuxRules::save(void)
+{
+    eeprom_update_byte((uint8_t *)EEPROM_RULES, 0xFF);
+    eeprom_update_block(_rules, (void *)(EEPROM_RULES + 1), sizeof(_rules));
+    eeprom_update_byte((uint8_t *)EEPROM_RULES, EEPROM_RULES_MAGIC);
+}
+
+boolean MuxRules::load(void)
+{
+    if (eeprom_read_byte((const uint8_t *)EEPROM_RULES) != EEPROM_RULES_MAGIC) return false;
+    
+    eeprom_read_block(_rules, (const void *)(EEPROM_RULES + 1), sizeof(_rules));
+    for (byte i = 0; i < RULE_MAX; i++){
+        if (!valid(_rules[i].input, _rules[i].condition, _rules[i].output, _rules[i].action)) _rules[i].input = RULE_UNUSED;
+    }
+    _level = 0;
+    _valid = 0;
+    
+    return true;
+}
+
+// make one instance for the sketch to use
+MuxRules Rules;
@@ -0,0 +1,80 @@
+/*
+MuxRules.h - Threshold rule engine for MuxFirmata.
+Each rule maps a condition on an analogue or digital input pin to an action on an output pin.
+Rules are evaluated once per completed scan and act only when their condition changes.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxRules_h
+#define MuxRules_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#include "Boards.h"
+
+#define RULE_MAX 8                      // rules in the table, 8 bytes of RAM each. Kept at 8 for the 2 KB parts, a table
+                                        // saved with more loads its first RULE_MAX rules
+#define RULE_UNUSED 0x7F                // input pin# of an empty rule
+
+#define RULE_ABOVE 0                    // conditions: value > hi
+#define RULE_BELOW 1                    // value < lo
+#define RULE_INSIDE 2                   // lo <= value <= hi
+#define RULE_OUTSIDE 3                  // value < lo or value > hi
+#define RULE_HYSTERESIS 4               // becomes true above hi, false below lo
+#define RULE_RISING 5                   // value rises above lo
+#define RULE_FALLING 6                  // value falls to lo or below
+
+#define RULE_FOLLOW 0                   // actions: output = condition
+#define RULE_INVERT 1                   // output = !condition
+#define RULE_SET 2                      // set output when condition triggers
+#define RULE_CLEAR 3                    // clear output when condition triggers
+#define RULE_TOGGLE 4                   // toggle output when condition triggers
+
+#define RULE_SOURCE_ANALOG 0            // evaluate rules on analogue pins, after an analogue sweep
+#define RULE_SOURCE_DIGITAL 1           // evaluate rules on digital pins, after a digital scan
+
+#define RULE_VALUE_TOGGLE 2             // value passed to the callback for RULE_TOGGLE
+
+extern "C" {
+    typedef void (*ruleCallbackFunction)(byte rule, byte pin, byte value);
+}
+
+class MuxRules {
+
+public:
+    MuxRules();
+
+    void clear(void);
+    boolean setRule(byte index, byte input, byte condition, byte output, byte action, unsigned int lo, unsigned int hi);
+    void attach(ruleCallbackFunction newFunction);
+
+    void evaluate(byte source, const int *analog, const byte *ports);
+
+    void save(void);
+    boolean load(void);
+
+private:
+    struct rule {
+        byte input;                             // firmata pin#, RULE_UNUSED if empty
+        byte condition;
+        byte output;                            // firmata pin#
+        byte action;
+        unsigned int lo, hi;
+    };
+
+    static boolean valid(byte input, byte condition, byte output, byte action);
+    
+    rule _rules[RULE_MAX];
+    unsigned int _level;                        // last condition of each rule, bit n = rule n
+    unsigned int _valid;                        // rule has been evaluated since it was set
+    ruleCallbackFunction _callback;
+};
+
+extern MuxRules Rules;
+
+#endif
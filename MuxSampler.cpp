@@ -0,0 +1,225 @@
+/*
+MuxSampler.cpp - Timer driven sample clock with jitter statistics.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * Each class clock is a MuxTimer timer that reschedules itself from its own callback, so the
+ * ticks stay exactly one period apart whatever the main loop is doing (100uS resolution).
+ * Jitter is the interval between two samples taken minus the period, measured in the foreground
+ * when the sample is actually taken. A tick that finds the previous flag still set is a missed sample.
+ * In frame mode the digital sample is taken in the timer interrupt, and measured there, so the
+ * foreground only resets, retimes or copies the statistics with interrupts off. It runs
+ * through MuxTimer::later(), with interrupts enabled: at about 140uS it would otherwise hold off
+ * the PWM planes and the UART. A PWM refresh that lands in the middle of it moves the address
+ * lines, and MuxShield::tryReadPortsMS() reads that channel again. If the foreground holds the
+ * mux lines the read is retried every tick, SAMPLE_RETRIES times at most.
+ * The analogue values are copied from the buffer the foreground is not writing, so a frame never
+ * holds half of one sweep and half of the next. They are kept packed, which saves 72 bytes of RAM
+ * over the queue and the double buffer and shortens the copy made in the interrupt.
+ */
+
+#include <Arduino.h>
+#include <avr/interrupt.h>
+
+#include "MuxSampler.h"
+
+
+static void samplerTimerCallback(byte sampleClass)
+{
+    Sampler.fire(sampleClass);
+}
+
+static void samplerSampleCallback(byte)
+{
+    Sampler.retry();
+}
+
+static void samplerRetryCallback(byte)
+{
+    if (!Timers.later(samplerSampleCallback, 0)) Sampler.retry();
+}
+
+
+MuxSampler::MuxSampler()
+{
+    for (byte i = 0; i < SAMPLE_CLASSES; i++){
+        _periodMs[i] = 0;
+        _ticks[i] = 0;
+        _due[i] = false;
+        _timer[i] = TIMER_NONE;
+    }
+    _mux = 0;
+    _muxMask = 0;
+    _sequence = 0;
+    _retries = 0;
+    _front = 0;
+    for (byte i = 0; i < SAMPLE_ANALOG_BYTES; i++) _analog[0][i] = _analog[1][i] = 0;
+    resetStats();
+}
+
+void MuxSampler::beginFrames(MuxShield &mux, int muxMask)
+{
+    _muxMask = muxMask;
+    _mux = &mux;
+}
+
+void MuxSampler::setAnalog(const int *values)
+{
+    muxPackAnalog(values, TOTAL_ANALOG_PINS, _analog[_front ^ 1]);
+    _front ^= 1;                                        // one byte write, the interrupt sees the old or the new sweep
+}
+
+void MuxSampler::begin(byte sampleClass, const unsigned long *periodMs)
+{
+    if (sampleClass >= SAMPLE_CLASSES) return;
+
+    _periodMs[sampleClass] = periodMs;
+    update(sampleClass);
+    _timer[sampleClass] = Timers.schedule(_ticks[sampleClass], samplerTimerCallback, sampleClass);
+}
+
+boolean MuxSampler::due(byte sampleClass)
+{
+    unsigned long now, dueAt;
+
+    if (!_periodMs[sampleClass]) return false;
+    if (*_periodMs[sampleClass] * 1000UL != _stats[sampleClass].period) update(sampleClass);        // the rate was changed
+    if (_timer[sampleClass] == TIMER_NONE){                                         // the wheel was full, try again
+        _timer[sampleClass] = Timers.schedule(_ticks[sampleClass], samplerTimerCallback, sampleClass);
+    }
+
+    if (!_due[sampleClass]) return false;
+
+    now = micros();
+    uint8_t oldSREG = SREG;
+    cli();
+    dueAt = _dueAt[sampleClass];
+    _due[sampleClass] = false;
+    SREG = oldSREG;
+
+    measure(sampleClass, now, dueAt);
+    return true;
+}
+
+void MuxSampler::measure(byte sampleClass, unsigned long now, unsigned long dueAt)
+{
+    samplerStats *s = &_stats[sampleClass];
+    unsigned long latency;
+    long jitter;
+
+    latency = now - dueAt;
+    if (latency > s->maxLatency) s->maxLatency = latency;
+
+    if (s->last){
+        jitter = (long)(now - s->last) - (long)s->period;
+        if (!s->count || jitter < s->minJitter) s->minJitter = jitter;
+        if (!s->count || jitter > s->maxJitter) s->maxJitter = jitter;
+        s->sumJitter += jitter;
+        s->count++;
+    }
+    s->last = now;
+}
+
+void MuxSampler::getStats(byte sampleClass, samplerStats &copy)
+{
+    uint8_t oldSREG = SREG;
+    cli();
+    copy = _stats[sampleClass];
+    SREG = oldSREG;
+}
+
+unsigned int MuxSampler::getMissed(byte sampleClass)
+{
+    unsigned int missed;
+
+    uint8_t oldSREG = SREG;
+    cli();
+    missed = _missed[sampleClass];
+    SREG = oldSREG;
+    return missed;
+}
+
+void MuxSampler::resetStats(void)
+{
+    uint8_t oldSREG = SREG;
+    cli();
+    for (byte i = 0; i < SAMPLE_CLASSES; i++){
+        _stats[i].last = 0;
+        _stats[i].count = 0;
+        _stats[i].minJitter = 0;
+        _stats[i].maxJitter = 0;
+        _stats[i].sumJitter = 0;
+        _stats[i].maxLatency = 0;
+        _missed[i] = 0;
+    }
+    SREG = oldSREG;
+}
+
+void MuxSampler::update(byte sampleClass)
+{
+    unsigned long ticks = MuxTimer::msToTicks(*_periodMs[sampleClass]);
+
+    if (ticks < 1) ticks = 1;
+
+    uint8_t oldSREG = SREG;
+    cli();
+    _ticks[sampleClass] = ticks;
+    _stats[sampleClass].period = *_periodMs[sampleClass] * 1000UL;
+    _stats[sampleClass].last = 0;                       // the change itself is not jitter
+    SREG = oldSREG;
+}
+
+void MuxSampler::fire(byte sampleClass)
+{
+    _timer[sampleClass] = Timers.schedule(_ticks[sampleClass], samplerTimerCallback, sampleClass);
+
+    if (sampleClass == SAMPLE_DIGITAL && _mux){         // frame mode, the sample is taken here
+        if (_retries) _missed[sampleClass]++;           // the previous sample never got the lines
+        _dueAt[sampleClass] = micros();
+        _retries = SAMPLE_RETRIES;
+        if (!Timers.later(samplerSampleCallback, 0)) retry();
+        return;
+    }
+
+    if (_due[sampleClass]) _missed[sampleClass]++;
+    _dueAt[sampleClass] = micros();
+    _due[sampleClass] = true;
+}
+
+void MuxSampler::retry(void)
+{
+    if (!_retries || sample()){
+        _retries = 0;
+        return;
+    }
+    if (--_retries == 0 || Timers.schedule(1, samplerRetryCallback, 0) == TIMER_NONE){
+        _retries = 0;
+        _missed[SAMPLE_DIGITAL]++;
+    }
+}
+
+boolean MuxSampler::sample(void)
+{
+    sampleFrame *frame;
+    const byte *analog;
+    unsigned long now;
+
+    frame = frames.claim();
+    if (!frame) return true;                            // the main loop is behind, counted in frames.dropped
+    if (!_mux->tryReadPortsMS(frame->digital, _muxMask)) return false;
+
+    now = micros();
+    frame->timestamp = now;
+    frame->sequence = _sequence++;
+    analog = _analog[_front];
+    for (byte i = 0; i < SAMPLE_ANALOG_BYTES; i++) frame->analog[i] = analog[i];
+    frames.publish();
+
+    measure(SAMPLE_DIGITAL, now, _dueAt[SAMPLE_DIGITAL]);
+    return true;
+}
+
+// make one instance for the timer wheel to use
+MuxSampler Sampler;
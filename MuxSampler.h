@@ -0,0 +1,98 @@
+/*
+MuxSampler.h - Timer driven sample clock with jitter statistics.
+The timer wheel raises a due flag with a timestamp for each sample class at its
+exact period, the main loop takes the sample when it sees the flag, and the
+interval between samples is checked against the period.
+With frames enabled the digital clock reads the input ports itself and queues
+sample frames (input words, last analogue sweep, timestamp) for the main loop.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxSampler_h
+#define MuxSampler_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#include "Boards.h"
+#include "MuxShields.h"
+#include "MuxTimer.h"
+#include "MuxQueue.h"
+#include "MuxFraming.h"
+
+#define SAMPLE_CLASSES 2                // sample classes with their own clock
+#define SAMPLE_DIGITAL 0
+#define SAMPLE_ANALOG 1
+#if MUX_KEYPAD
+#define SAMPLE_FRAMES 1                 // the keypad replaces the digital scan, no frames are produced
+#else
+#define SAMPLE_FRAMES 4                 // frames queued between the digital clock and the main loop, power of 2
+#endif
+#define SAMPLE_RETRIES 10               // ticks the digital clock waits for the mux lines before the sample is missed
+#define SAMPLE_ANALOG_BYTES             ((TOTAL_ANALOG_PINS * 10 + 7) / 8)     // one sweep packed by muxPackAnalog()
+
+struct sampleFrame {
+    unsigned long timestamp;                    // micros() when the inputs were read
+    byte sequence;                              // counts frames produced, gaps show dropped frames
+    unsigned int digital[PORTS];                // input words, bit n = channel n, 1 = input low
+    byte analog[SAMPLE_ANALOG_BYTES];           // last complete analogue sweep, 10 bits per channel, see muxUnpackAnalog()
+};
+
+struct samplerStats {
+    unsigned long period;                       // uS the clock currently runs at
+    unsigned long last;                         // micros() of the previous sample
+    unsigned long count;                        // intervals measured
+    long minJitter, maxJitter;                  // interval - period (uS)
+    long sumJitter;
+    unsigned long maxLatency;                   // longest wait from the due flag to the sample (uS)
+};
+
+class MuxSampler {
+
+public:
+    MuxSampler();
+
+    void begin(byte sampleClass, const unsigned long *periodMs);
+    void beginFrames(MuxShield &mux, int muxMask);      // the digital clock reads the ports in muxMask into frames
+    boolean due(byte sampleClass);              // true once per tick of the class clock, call from the foreground, never true for framed digital
+    void setAnalog(const int *values);          // hand a complete analogue sweep to the frames
+    const byte *getAnalog(void) { return _analog[_front]; }    // the last sweep handed over, packed as in a frame
+    void resetStats(void);
+
+    MuxQueue<sampleFrame, SAMPLE_FRAMES> frames;
+
+    void getStats(byte sampleClass, samplerStats &copy);    // all of one class at once, frames are measured in the interrupt
+    static long getMeanJitter(const samplerStats &s) { return s.count ? s.sumJitter / (long)s.count : 0; }
+    unsigned int getMissed(byte sampleClass);
+
+    void fire(byte sampleClass);                // called from the timer wheel only
+    void retry(void);
+
+private:
+    const unsigned long *_periodMs[SAMPLE_CLASSES];
+    unsigned long _ticks[SAMPLE_CLASSES];       // clock period in timer ticks, read by fire()
+    volatile boolean _due[SAMPLE_CLASSES];
+    volatile unsigned long _dueAt[SAMPLE_CLASSES];      // micros() when the flag was raised
+    volatile unsigned int _missed[SAMPLE_CLASSES];      // ticks that found the previous sample not yet taken
+    byte _timer[SAMPLE_CLASSES];
+    samplerStats _stats[SAMPLE_CLASSES];        // the foreground changes them with interrupts off
+
+    MuxShield *_mux;                            // set when the digital clock produces frames
+    int _muxMask;
+    byte _sequence;
+    byte _retries;                              // retries left for the sample in progress
+    byte _analog[2][SAMPLE_ANALOG_BYTES];       // double buffer, the foreground fills the one _front doesn't point at
+    volatile byte _front;
+
+    void update(byte sampleClass);
+    void measure(byte sampleClass, unsigned long now, unsigned long dueAt);
+    boolean sample(void);
+};
+
+extern MuxSampler Sampler;
+
+#endif
@@ -0,0 +1,101 @@
+/*
+MuxScheduler.cpp - Cooperative task scheduler for the MuxFirmata main loop.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * Every pass visits the tasks in order and runs those that are due or left work unfinished,
+ * so the worst case wait of any task is bounded by the budgets of the tasks before it.
+ * A sliced task keeps its due time: the rest of its work runs on the next pass, not a period later.
+ * A task that falls a whole period behind is resynchronised to now instead of running back to back.
+ */
+
+#include <Arduino.h>
+
+#include "MuxScheduler.h"
+
+
+MuxScheduler::MuxScheduler()
+{
+    _count = 0;
+    _start = 0;
+    _budget = 0;
+    _cycleStart = 0;
+    cycleUs = 0;
+    maxCycleUs = 0;
+}
+
+byte MuxScheduler::add(taskCallbackFunction newFunction, const unsigned long *periodMs, unsigned int deadlineUs, unsigned int budgetUs)
+{
+    task *t;
+
+    if (_count >= TASK_MAX) return TASK_NONE;
+
+    t = &_tasks[_count];
+    t->callback = newFunction;
+    t->period = periodMs;
+    t->deadline = deadlineUs;
+    t->budget = budgetUs;
+    t->due = micros();
+    t->maxRun = 0;
+    t->misses = 0;
+    t->overruns = 0;
+    t->sliced = false;
+
+    return _count++;
+}
+
+void MuxScheduler::run(void)
+{
+    unsigned long now, period, elapsed;
+    task *t;
+
+    now = micros();
+    if (_cycleStart){
+        cycleUs = now - _cycleStart;
+        if (cycleUs > maxCycleUs) maxCycleUs = cycleUs;
+    }
+    _cycleStart = now;
+
+    for (byte i = 0; i < _count; i++){
+        t = &_tasks[i];
+        now = micros();
+        period = t->period ? *t->period * 1000UL : 0;
+
+        if (!t->sliced && period){
+            if ((long)(now - t->due) < 0) continue;             // not due yet
+
+            if (now - t->due > t->deadline) t->misses++;
+            t->due += period;
+            if ((long)(now - t->due) >= 0) t->due = now + period;
+        }
+
+        _start = now;
+        _budget = t->budget;
+        t->sliced = (*t->callback)();
+
+        elapsed = micros() - now;
+        if (elapsed > 0xFFFF) elapsed = 0xFFFF;
+        if (elapsed > t->maxRun) t->maxRun = elapsed;
+        if (elapsed > t->budget) t->overruns++;
+    }
+}
+
+boolean MuxScheduler::expired(void)
+{
+    return micros() - _start >= _budget;
+}
+
+void MuxScheduler::resetStats(void)
+{
+    for (byte i = 0; i < _count; i++){
+        _tasks[i].maxRun = 0;
+        _tasks[i].misses = 0;
+        _tasks[i].overruns = 0;
+    }
+    maxCycleUs = 0;
+}
+
+// make one instance for the main loop to use
+MuxScheduler Scheduler;
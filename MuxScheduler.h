@@ -0,0 +1,67 @@
+/*
+MuxScheduler.h - Cooperative task scheduler for the MuxFirmata main loop.
+Periodic tasks run in the order they were added, each with a period, a deadline
+for how late it may start and a time budget that long jobs use to split their
+work into resumable slices.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxScheduler_h
+#define MuxScheduler_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#define TASK_MAX 7                      // tasks that can be added, 21 bytes of RAM each. MuxFirmata adds 7 with
+                                        // everything enabled, add() returns TASK_NONE past that
+#define TASK_NONE 0xFF                  // returned when no task slot is free
+
+extern "C" {
+    typedef boolean (*taskCallbackFunction)(void);      // return true if work is left, the task runs again next pass
+}
+
+class MuxScheduler {
+
+public:
+    MuxScheduler();
+
+    byte add(taskCallbackFunction newFunction, const unsigned long *periodMs, unsigned int deadlineUs, unsigned int budgetUs);
+    void run(void);                             // one pass over the tasks, call from loop()
+    boolean expired(void);                      // true once the running task has used up its budget
+    void resetStats(void);
+
+    byte getCount(void) { return _count; }
+    unsigned int getMaxRun(byte id) { return _tasks[id].maxRun; }
+    unsigned int getMisses(byte id) { return _tasks[id].misses; }
+    unsigned int getOverruns(byte id) { return _tasks[id].overruns; }
+
+    unsigned long cycleUs;                      // length of the last pass
+    unsigned long maxCycleUs;                   // longest pass since resetStats()
+
+private:
+    struct task {
+        taskCallbackFunction callback;
+        const unsigned long *period;            // mS, read on every pass so rate changes apply at once, 0 = every pass
+        unsigned int deadline;                  // uS a run may start late before it counts as a miss
+        unsigned int budget;                    // uS per run
+        unsigned long due;                      // micros() of the next run
+        unsigned int maxRun;                    // longest run (uS)
+        unsigned int misses;                    // runs started later than the deadline
+        unsigned int overruns;                  // runs longer than the budget
+        boolean sliced;                         // the last run left work to finish
+    };
+
+    task _tasks[TASK_MAX];
+    byte _count;
+    unsigned long _start;                       // micros() when the running task started
+    unsigned int _budget;                       // its budget
+    unsigned long _cycleStart;
+};
+
+extern MuxScheduler Scheduler;
+
+#endif
@@ -0,0 +1,146 @@
+/*
+MuxSequencer.cpp - Output pattern sequencer for the shift register outputs of Mayhew Labs' Mux Shield.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * EEPROM layout at EEPROM_SEQUENCER: magic, length, boot mode, then length steps as stored in RAM.
+ * The magic byte is cleared while the table is written so a partial save is never loaded.
+ */
+
+#include <Arduino.h>
+
+#include "MuxSequencer.h"
+#include "MuxEEPROM.h"
+
+
+static void sequencerTimerCallback(byte arg)
+{
+    Sequencer.next();
+}
+
+
+MuxSequencer::MuxSequencer()
+{
+    _mux = 0;
+    _length = 0;
+    _index = 0;
+    _mode = SEQ_ONCE;
+    _timer = TIMER_NONE;
+    _playing = false;
+}
+
+void MuxSequencer::begin(MuxShield &mux)
+{
+    _mux = &mux;
+}
+
+void MuxSequencer::clear(void)
+{
+    stop();
+    _length = 0;
+}
+
+boolean MuxSequencer::setStep(byte index, unsigned int duration, const unsigned int *words)
+{
+    byte port;
+    
+    if (index >= SEQ_MAX_STEPS || index > _length) return false;    // steps are appended in order
+    
+    uint8_t oldSREG = SREG;
+    cli();                                      // the table may be playing
+    _steps[index].duration = duration;
+    for (port = 0; port < TOTAL_MUX_OUT_PORTS; port++) _steps[index].words[port] = words[port];
+    if (index == _length) _length++;
+    SREG = oldSREG;
+    
+    return true;
+}
+
+byte MuxSequencer::getLength(void)
+{
+    return _length;
+}
+
+void MuxSequencer::play(byte mode)
+{
+    stop();
+    if (!_mux || _length == 0) return;
+    
+    _mode = mode;
+    _index = 0;
+    _playing = true;
+    _timer = Timers.schedule(1, sequencerTimerCallback, 0);
+    if (_timer == TIMER_NONE) _playing = false;
+}
+
+void MuxSequencer::stop(void)
+{
+    uint8_t oldSREG = SREG;
+    cli();
+    if (_playing) Timers.cancel(_timer);
+    _playing = false;
+    _timer = TIMER_NONE;
+    SREG = oldSREG;
+}
+
+boolean MuxSequencer::isPlaying(void)
+{
+    return _playing;
+}
+
+void MuxSequencer::next(void)
+{
+    unsigned int vals[PORTS];
+    byte mux, port = 0;
+    
+    if (_index >= _length){                     // last step has run its time
+        if (_mode != SEQ_LOOP){
+            _playing = false;
+            _timer = TIMER_NONE;
+            return;
+        }
+        _index = 0;
+    }
+    
+    for (mux = 1; mux <= PORTS; mux++){
+        if (MUX_OUT_PORT_MASK & (1 << (mux-1))) vals[mux-1] = _steps[_index].words[port++];
+    }
+    _mux->digitalWritePortsMS(vals, MUX_OUT_PORT_MASK);
+    
+    _timer = Timers.schedule(MuxTimer::msToTicks(_steps[_index].duration), sequencerTimerCallback, 0);
+    if (_timer == TIMER_NONE) _playing = false;
+    _index++;
+}
+
+void MuxSequencer::save(byte bootMode)
+{
+    eeprom_update_byte((uint8_t *)EEPROM_SEQUENCER, 0xFF);
+    eeprom_update_byte((uint8_t *)(EEPROM_SEQUENCER + 1), _length);
+    eeprom_update_byte((uint8_t *)(EEPROM_SEQUENCER + 2), bootMode);
+    eeprom_update_block(_steps, (void *)(EEPROM_SEQUENCER + 3), _length * sizeof(step));
+    eeprom_update_byte((uint8_t *)EEPROM_SEQUENCER, EEPROM_SEQUENCER_MAGIC);
+}
+
+boolean MuxSequencer::load(void)
+{
+    byte length, bootMode;
+    
+    if (eeprom_read_byte((const uint8_t *)EEPROM_SEQUENCER) != EEPROM_SEQUENCER_MAGIC) return false;
+    
+    length = eeprom_read_byte((const uint8_t *)(EEPROM_SEQUENCER + 1));
+    bootMode = eeprom_read_byte((const uint8_t *)(EEPROM_SEQUENCER + 2));
+    if (length > SEQ_MAX_STEPS) return false;
+    
+    stop();
+    eeprom_read_block(_steps, (const void *)(EEPROM_SEQUENCER + 3), length * sizeof(step));
+    _length = length;
+    
+    if (bootMode == SEQ_ONCE || bootMode == SEQ_LOOP) play(bootMode);
+    
+    return true;
+}
+
+// make one instance for the timer wheel to use
+MuxSequencer Sequencer;
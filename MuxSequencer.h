@@ -0,0 +1,65 @@
+/*
+MuxSequencer.h - Output pattern sequencer for the shift register outputs of Mayhew Labs' Mux Shield.
+A table of steps, each a duration and one 16 bit word per output port, is played from the
+timer wheel interrupt. Every step is committed to all output ports with a single latch.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxSequencer_h
+#define MuxSequencer_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#include "Boards.h"
+#include "MuxShields.h"
+#include "MuxTimer.h"
+
+#define SEQ_MAX_STEPS 16                // steps held in RAM, 4 bytes each with one output port. Kept at 16 for the 2 KB
+                                        // parts, a saved table longer than this is not loaded
+
+#define SEQ_ONCE 0                      // play the table once and hold the last step
+#define SEQ_LOOP 1                      // play the table until stopped
+#define SEQ_NONE 0x7F                   // boot mode: load the table but do not play it
+
+class MuxSequencer {
+
+public:
+    MuxSequencer();
+
+    void begin(MuxShield &mux);
+    void clear(void);
+    boolean setStep(byte index, unsigned int duration, const unsigned int *words);   // words[] one per output port, lowest port first
+    byte getLength(void);
+
+    void play(byte mode);
+    void stop(void);
+    boolean isPlaying(void);
+
+    void save(byte bootMode);                   // bootMode is how load() will start the table
+    boolean load(void);
+
+    void next(void);                            // called from the timer wheel only
+
+private:
+    struct step {
+        unsigned int duration;                  // mS
+        unsigned int words[TOTAL_MUX_OUT_PORTS];
+    };
+
+    MuxShield *_mux;
+    step _steps[SEQ_MAX_STEPS];
+    byte _length;
+    byte _index;                                // step committed next
+    byte _mode;
+    byte _timer;
+    volatile boolean _playing;
+};
+
+extern MuxSequencer Sequencer;
+
+#endif
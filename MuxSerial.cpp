@@ -0,0 +1,216 @@
+/*
+MuxSerial.cpp - Interrupt driven UART0 transport for Firmata.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * The USART_RX and USART_UDRE vectors are defined here, so the core's Serial must not be
+ * referenced anywhere when this transport is used (see MUX_SERIAL_TRANSPORT in Boards.h). With
+ * MUX_SERIAL_TRANSPORT 0 the file compiles to nothing and leaves the vectors to the core.
+ * U2X is always on: 250000 and 500000 baud have exact divisors at 16MHz, 57600 and 115200 are
+ * within 2.1%.
+ * The receive interrupt only moves one byte into the ring, so it keeps up between the
+ * interrupt-free windows of SendOnlySoftwareSerial as long as the UART's 3 byte hardware
+ * buffer does, any byte lost there is counted from the data overrun flag.
+ * Firmata parses the received bytes where they lie in the ring, through peekBlock() and
+ * consume(), so the ring needs no second copy on the stack.
+ */
+
+#include <Arduino.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "MuxSerial.h"
+
+#if MUX_SERIAL_TRANSPORT
+
+MuxSerial::MuxSerial()
+{
+    _rxHead = _rxTail = 0;
+    _txHead = _txTail = 0;
+    _rxBlock = 0;
+    _written = false;
+    rxOverruns = 0;
+    txStalls = 0;
+}
+
+void MuxSerial::begin(unsigned long baud)
+{
+    uint16_t setting = (F_CPU / 4 / baud - 1) / 2;      // rounded divisor for U2X mode
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        UCSR0B = 0;
+        _rxHead = _rxTail = 0;                          // anything half received at the old rate is noise
+        _txHead = _txTail = 0;
+        _rxBlock = 0;                                   // a block being parsed is not consumed from the new ring
+    }
+    UCSR0A = _BV(U2X0);
+    UBRR0H = setting >> 8;
+    UBRR0L = setting;
+    UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);                 // 8N1
+    UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+    _written = false;
+}
+
+void MuxSerial::end(void)
+{
+    flush();
+    UCSR0B = 0;
+    _rxHead = _rxTail;
+    _rxBlock = 0;
+}
+
+int MuxSerial::available(void)
+{
+    return (byte)(_rxHead - _rxTail) & (MUX_SERIAL_RX_SIZE - 1);
+}
+
+int MuxSerial::peek(void)
+{
+    if (_rxHead == _rxTail) return -1;
+    return _rxBuffer[_rxTail];
+}
+
+int MuxSerial::read(void)
+{
+    byte c;
+
+    if (_rxHead == _rxTail) return -1;
+    c = _rxBuffer[_rxTail];
+    _rxTail = (_rxTail + 1) & (MUX_SERIAL_RX_SIZE - 1);
+    return c;
+}
+
+size_t MuxSerial::read(uint8_t *buffer, size_t size)
+{
+    byte head = _rxHead, tail = _rxTail;
+    size_t count = 0;
+
+    while (tail != head && count < size){
+        buffer[count++] = _rxBuffer[tail];
+        tail = (tail + 1) & (MUX_SERIAL_RX_SIZE - 1);
+    }
+    _rxTail = tail;
+    return count;
+}
+
+size_t MuxSerial::peekBlock(const uint8_t **block)
+{
+    byte head = _rxHead, tail = _rxTail;
+
+    *block = _rxBuffer + tail;
+    _rxBlock = (head >= tail) ? head - tail : MUX_SERIAL_RX_SIZE - tail;
+    return _rxBlock;
+}
+
+void MuxSerial::consume(size_t count)
+{
+    if (count > _rxBlock) count = _rxBlock;
+    _rxBlock -= count;
+    _rxTail = (_rxTail + count) & (MUX_SERIAL_RX_SIZE - 1);
+}
+
+int MuxSerial::availableForWrite(void)
+{
+    return (MUX_SERIAL_TX_SIZE - 1) - ((byte)(_txHead - _txTail) & (MUX_SERIAL_TX_SIZE - 1));
+}
+
+void MuxSerial::flush(void)
+{
+    if (!_written) return;
+
+    // wait for the ring to empty and the last byte to leave the shift register
+    while (bit_is_set(UCSR0B, UDRIE0) || bit_is_clear(UCSR0A, TXC0)){
+        if (bit_is_clear(SREG, SREG_I) && bit_is_set(UCSR0B, UDRIE0) && bit_is_set(UCSR0A, UDRE0)) udreInterrupt();
+    }
+}
+
+inline void MuxSerial::put(uint8_t c)
+{
+    byte next = (_txHead + 1) & (MUX_SERIAL_TX_SIZE - 1);
+
+    if (next == _txTail){
+        txStalls++;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){ UCSR0B |= _BV(UDRIE0); }
+        while (next == _txTail){
+            // with interrupts off (called from an interrupt) move the ring by polling
+            if (bit_is_clear(SREG, SREG_I) && bit_is_set(UCSR0A, UDRE0)) udreInterrupt();
+        }
+    }
+    _txBuffer[_txHead] = c;
+    _txHead = next;
+}
+
+size_t MuxSerial::write(uint8_t c)
+{
+    _written = true;
+
+    // ring empty and data register free: skip the ring, as HardwareSerial does
+    if (_txHead == _txTail && bit_is_set(UCSR0A, UDRE0)){
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+            UDR0 = c;
+            UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0);
+        }
+        return 1;
+    }
+    put(c);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){ UCSR0B |= _BV(UDRIE0); }
+    return 1;
+}
+
+size_t MuxSerial::write(const uint8_t *buffer, size_t size)
+{
+    size_t count = size;
+
+    if (!size) return 0;
+    _written = true;
+
+    while (count--) put(*buffer++);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){ UCSR0B |= _BV(UDRIE0); }
+    return size;
+}
+
+void MuxSerial::rxInterrupt(void)
+{
+    byte status = UCSR0A;
+    byte c = UDR0;
+    byte next;
+
+    if (status & _BV(DOR0)) rxOverruns++;               // lost while interrupts were off
+    if (status & _BV(UPE0)) return;                     // parity error, drop as HardwareSerial does
+
+    next = (_rxHead + 1) & (MUX_SERIAL_RX_SIZE - 1);
+    if (next == _rxTail){
+        rxOverruns++;
+        return;
+    }
+    _rxBuffer[_rxHead] = c;
+    _rxHead = next;
+}
+
+void MuxSerial::udreInterrupt(void)
+{
+    byte c = _txBuffer[_txTail];
+
+    _txTail = (_txTail + 1) & (MUX_SERIAL_TX_SIZE - 1);
+    UDR0 = c;
+    UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0);          // clear TXC so flush() can wait for it
+
+    if (_txHead == _txTail) UCSR0B &= ~_BV(UDRIE0);
+}
+
+ISR(USART_RX_vect)
+{
+    Uart.rxInterrupt();
+}
+
+ISR(USART_UDRE_vect)
+{
+    Uart.udreInterrupt();
+}
+
+// make one instance for the UART interrupts to use
+MuxSerial Uart;
+
+#endif
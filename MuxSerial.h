@@ -0,0 +1,67 @@
+/*
+MuxSerial.h - Interrupt driven UART0 transport for Firmata.
+Replaces the core's HardwareSerial with compile-time sized rings, U2X baud
+divisors and bulk read/write, and counts receive overruns and transmit stalls.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxSerial_h
+#define MuxSerial_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#include "Boards.h"
+
+#if MUX_SERIAL_TRANSPORT
+
+#define MUX_SERIAL_RX_SIZE 128          // receive ring, must be a power of 2 no larger than 256, 11mS at 115200
+#define MUX_SERIAL_TX_SIZE 64           // transmit ring, must be a power of 2 no larger than 256, twice the core's
+
+class MuxSerial : public Stream {
+
+public:
+    MuxSerial();
+
+    void begin(unsigned long baud);
+    void end(void);
+
+    virtual int available(void);
+    virtual int peek(void);
+    virtual int read(void);
+    size_t read(uint8_t *buffer, size_t size);  // copy out what has arrived, never waits
+    size_t peekBlock(const uint8_t **block);    // the received bytes up to the end of the ring, left in place
+    void consume(size_t count);                 // drop count bytes of that block once they are used
+    int availableForWrite(void);
+    virtual void flush(void);
+    virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    operator bool() { return true; }
+
+    void rxInterrupt(void);                     // called from the UART interrupts only
+    void udreInterrupt(void);
+
+    volatile unsigned long rxOverruns;          // bytes lost, ring full or UART data overrun
+    unsigned long txStalls;                     // writes that had to wait for room in the ring
+
+private:
+    volatile byte _rxHead, _rxTail;
+    volatile byte _txHead, _txTail;
+    byte _rxBlock;                              // bytes peekBlock() handed out, begin() takes them back
+    byte _rxBuffer[MUX_SERIAL_RX_SIZE];
+    byte _txBuffer[MUX_SERIAL_TX_SIZE];
+    boolean _written;                           // something was sent since begin(), flush() has to wait
+
+    inline void put(uint8_t c);
+};
+
+extern MuxSerial Uart;
+
+#endif
+
+#endif
@@ -14,6 +14,15 @@ Released into the public domain.
  * Added error handling in case of invalid input to member functions
  * Added getMode member function
  * Added setAddress member function
+ * Stored shift register contents as one 16-bit word per port
+ * Added word-wide port write (single latch) and bulk port read functions
+ * Added fast shift path using cached port registers in place of digitalWrite
+ * Added PWM overlay so a timer interrupt can refresh output ports between foreground accesses
+ * Added digitalWriteBitsMS and digitalWritePortsMS for changing outputs from a timer interrupt
+ * Added beginBatchMS/endBatchMS to collect foreground writes and shift each changed port once
+ * Interrupt refreshes shift the committed words in _latched, so a batch never shows half done
+ * Added tryReadPortsMS for sampling inputs from a timer interrupt
+ * tryReadPortsMS runs with interrupts enabled, a refresh in the middle of a channel makes it read that channel again
 
 
  */
@@ -22,15 +31,27 @@ Released into the public domain.
 
 #include "MuxShields.h"
 
-int _shiftReg1[16]={0};
-int _shiftReg2[16]={0};
-int _shiftReg3[16]={0};
-int _shiftReg4[16]={0};
-int _shiftReg5[16]={0};
-int _shiftReg6[16]={0};
+unsigned int _shiftReg[6] = {0};  // current contents of each port's shift registers, bit n = channel n
+unsigned int _latched[6] = {0};   // the words shiftPort() sends: _shiftReg without the writes of an open batch
 
 int _muxMode[6] = {0};      // added to store current mode of ports
 
+unsigned int _pwmMask[6] = {0};                  // channels of each port driven by the PWM overlay
+volatile unsigned int _pwmBits[6] = {0};         // overlay bits currently shown on those channels
+
+volatile byte _busy = 0;                         // set while the foreground is using the address/clock lines
+volatile byte _pending = 0;                      // ports (bit 0 = port 1) whose refresh was deferred because of _busy
+volatile byte _shifts = 0;                       // counts shifts, tryReadPortsMS sees the address lines were moved under it
+
+byte _batch = 0;                                 // nesting depth of beginBatchMS()
+byte _batchPorts = 0;                            // ports written while batching, shifted by endBatchMS()
+
+static inline void fastWrite(volatile uint8_t *reg, uint8_t mask, uint8_t val) __attribute__((always_inline));
+static inline void fastWrite(volatile uint8_t *reg, uint8_t mask, uint8_t val)
+{
+    if (val) *reg |= mask; else *reg &= ~mask;
+}
+
 
 MuxShield::MuxShield(int S0, int S1, int S2, int S3, int S4, int S5, int S6, int OUTMD ,int IOS1, int IOS2, int IOS3, int IO1, int IO2, int IO3, int IO4, int IO5, int IO6)
 {
@@ -83,6 +104,7 @@ MuxShield::MuxShield(int S0, int S1, int S2, int S3, int S4, int S5, int S6, int
     pinMode(_IOS2,OUTPUT);
     pinMode(_IOS3,OUTPUT);
     
+    cacheRegisters();
 }
 
 MuxShield::MuxShield()
@@ -130,6 +152,27 @@ MuxShield::MuxShield()
     pinMode(_IOS2,OUTPUT);
     pinMode(_IOS3,OUTPUT);    
     
+    cacheRegisters();
+}
+
+
+void MuxShield::cacheRegisters()                // added for fast shift path, looks up port registers once
+{
+    int sclk[6] = {_S0, _S1, _S2, _S4, _S5, _S6};
+    int io[6] = {_IO1, _IO2, _IO3, _IO4, _IO5, _IO6};
+    
+    for (int i=0; i<PORTS; i++){
+        _sclkReg[i] = portOutputRegister(digitalPinToPort(sclk[i]));
+        _sclkMask[i] = digitalPinToBitMask(sclk[i]);
+        _ioReg[i] = portOutputRegister(digitalPinToPort(io[i]));
+        _ioInReg[i] = portInputRegister(digitalPinToPort(io[i]));
+        _ioMask[i] = digitalPinToBitMask(io[i]);
+    }
+    
+    _lclkReg = portOutputRegister(digitalPinToPort(_S3));
+    _lclkMask = digitalPinToBitMask(_S3);
+    _outmdReg = portOutputRegister(digitalPinToPort(_OUTMD));
+    _outmdMask = digitalPinToBitMask(_OUTMD);
 }
 
 
@@ -272,75 +315,221 @@ void MuxShield::setMode(int mux, int mode)      // mode of MUX ports 4,5,6 set i
 
 void MuxShield::digitalWriteMS(int mux, int chan, int val)      // modified to accept writes to ports 4,5,6
 {
-    int i=16;
-    
-    if(chan<CHANNELS){
-        digitalWrite(_S3,LOW);                              //S3 here is LCLK
-        digitalWrite(_OUTMD,HIGH);                          //set to output mode
+    if(mux>=1 && mux<=PORTS && chan>=0 && chan<CHANNELS){
+        uint8_t oldSREG = SREG;
+        cli();                                              //interrupts may change other channels of this port
+        if (val) _shiftReg[mux-1] |= (1u << chan);          //store value until updated again
+        else _shiftReg[mux-1] &= ~(1u << chan);
+        if (!_batch) _latched[mux-1] = _shiftReg[mux-1];    //a batch is committed by endBatchMS()
+        SREG = oldSREG;
+
+        if (_batch){                                        //shifted out by endBatchMS()
+            _batchPorts |= (1 << (mux-1));
+            return;
+        }
 
-        switch (mux) {
-            case 1:
-                _shiftReg1[chan] = val;                     //store value until updated again            
-                for (i=15; i>=0; i--) {
-                    digitalWrite(_S0,LOW);                  //S0 here is i/o1 _sclk
-                    digitalWrite(_IO1,_shiftReg1[i]);       //put value
-                    digitalWrite(_S0,HIGH);                 //latch in value
-                }
-                break;
+        beginAccess();
+        beginShift();
+        shiftPort(mux);
+        endShift();
+        endAccess();
+    }
+}
 
-            case 2:
-                _shiftReg2[chan] = val;            
-                for (i=15; i>=0; i--) {
-                    digitalWrite(_S1,LOW);
-                    digitalWrite(_IO2,_shiftReg2[i]);
-                    digitalWrite(_S1,HIGH);
-                }
-                break;
+void MuxShield::digitalWritePortMS(int mux, unsigned int val)  // added to write all 16 channels with a single latch
+{
+    if(mux>=1 && mux<=PORTS){
+        uint8_t oldSREG = SREG;
+        cli();
+        _shiftReg[mux-1] = val;
+        if (!_batch) _latched[mux-1] = val;
+        SREG = oldSREG;
+
+        if (_batch){
+            _batchPorts |= (1 << (mux-1));
+            return;
+        }
 
-            case 3:
-                _shiftReg3[chan] = val;            
-                for (i=15; i>=0; i--) {
-                    digitalWrite(_S2,LOW);
-                    digitalWrite(_IO3,_shiftReg3[i]);
-                    digitalWrite(_S2,HIGH);
-                }
-                break;
+        beginAccess();
+        beginShift();
+        shiftPort(mux);
+        endShift();
+        endAccess();
+    }
+}
 
-            case 4:                                         //added for port 4
-                _shiftReg4[chan] = val;            
-                for (i=15; i>=0; i--) {
-                    digitalWrite(_S4,LOW);
-                    digitalWrite(_IO4,_shiftReg4[i]);
-                    digitalWrite(_S4,HIGH);
-                }
-                break;
+void MuxShield::beginBatchMS()                                 // added to hold foreground writes in the shift register copies
+{
+    _batch++;
+}
 
-            case 5:                                         //added for port 5
-                _shiftReg5[chan] = val;            
-                for (i=15; i>=0; i--) {
-                    digitalWrite(_S5,LOW);
-                    digitalWrite(_IO5,_shiftReg5[i]);
-                    digitalWrite(_S5,HIGH);
-                }
-                break;
+void MuxShield::endBatchMS()                                   // added to shift every port written since beginBatchMS() with one latch
+{
+    int mux;
+    
+    if (!_batch || --_batch) return;
+    if (!_batchPorts) return;
+    
+    uint8_t oldSREG = SREG;
+    cli();                                              //the interrupt refreshes see the whole batch at once
+    for (mux=1; mux<=PORTS; mux++){
+        if (_batchPorts & (1 << (mux-1))) _latched[mux-1] = _shiftReg[mux-1];
+    }
+    SREG = oldSREG;
+    
+    beginAccess();
+    beginShift();
+    for (mux=1; mux<=PORTS; mux++){
+        if (_batchPorts & (1 << (mux-1))) shiftPort(mux);
+    }
+    endShift();
+    _batchPorts = 0;
+    endAccess();
+}
 
-            case 6:                                         //added for port 6
-                _shiftReg6[chan] = val;            
-                for (i=15; i>=0; i--) {
-                    digitalWrite(_S6,LOW);
-                    digitalWrite(_IO6,_shiftReg6[i]);
-                    digitalWrite(_S6,HIGH);
-                }
-                break;           
+unsigned int MuxShield::getPortMS(int mux)                     // added to return current contents of port's shift registers
+{
+    if(mux>=1 && mux<=6) return _shiftReg[mux-1]; else return 0;
+}
 
-            default:
-                break;   
+void MuxShield::setPWMMask(int mux, unsigned int mask)         // added to hand channels over to the PWM overlay
+{
+    if(mux>=1 && mux<=PORTS){
+        uint8_t oldSREG = SREG;
+        cli();
+        _pwmMask[mux-1] = mask;
+        SREG = oldSREG;
+    }
+}
+
+boolean MuxShield::refreshPWM(const unsigned int *bits, int muxMask)    // added for timer interrupt, shows overlay bits on the PWM ports
+{
+    int mux;
+    byte ports = 0;
+    
+    for (mux=1; mux<=PORTS; mux++){
+        if (!(muxMask & (1 << (mux-1)))) continue;
+        _pwmBits[mux-1] = *bits++;
+        if (_pwmMask[mux-1]) ports |= (1 << (mux-1));
+    }
+    
+    return refreshPorts(ports);
+}
+
+boolean MuxShield::digitalWriteBitsMS(int mux, unsigned int setMask, unsigned int clearMask)   // added for timer interrupt
+{
+    if(mux<1 || mux>PORTS) return false;
+    
+    uint8_t oldSREG = SREG;
+    cli();
+    _shiftReg[mux-1] = (_shiftReg[mux-1] & ~clearMask) | setMask;
+    _latched[mux-1] = (_latched[mux-1] & ~clearMask) | setMask;     //shown now, an open batch keeps its own writes
+    SREG = oldSREG;
+    
+    return refreshPorts(1 << (mux-1));
+}
+
+boolean MuxShield::digitalWritePortsMS(const unsigned int *vals, int muxMask)   // added for timer interrupt, one latch for all ports
+{
+    int mux;
+    byte ports = 0;
+    
+    uint8_t oldSREG = SREG;
+    cli();
+    for (mux=1; mux<=PORTS; mux++){
+        if (muxMask & (1 << (mux-1))){
+            _shiftReg[mux-1] = _latched[mux-1] = vals[mux-1];
+            ports |= (1 << (mux-1));
         }
+    }
+    SREG = oldSREG;
+    
+    return refreshPorts(ports);
+}
+
+boolean MuxShield::refreshPorts(byte ports)
+{
+    _pending |= ports;
+    
+    if (_busy) return false;                            // foreground owns the lines, it will refresh in endAccess()
+    
+    shiftPendingPorts();
+    return true;
+}
 
-        digitalWrite(_S3,HIGH);                     //latch in ports 1 to 6
-        digitalWrite(_OUTMD,LOW);                   //Exit output mode
+void MuxShield::shiftPendingPorts()
+{
+    int mux;
+    
+    beginShift();
+    for (mux=1; mux<=PORTS; mux++){
+        if (_pending & (1 << (mux-1))) shiftPort(mux);
     }
+    endShift();
+    _pending = 0;
+}
+
+void MuxShield::beginAccess()
+{
+    _busy = 1;
+}
+
+void MuxShield::endAccess()
+{
+    _busy = 0;
     
+    if (_pending){
+        uint8_t oldSREG = SREG;
+        cli();                                          // a deferred refresh is short, run it with the timers held off
+        shiftPendingPorts();
+        SREG = oldSREG;
+    }
+}
+
+void MuxShield::beginShift()
+{
+    fastWrite(_lclkReg, _lclkMask, LOW);                //S3 here is LCLK
+    fastWrite(_outmdReg, _outmdMask, HIGH);             //set to output mode
+}
+
+void MuxShield::endShift()
+{
+    fastWrite(_lclkReg, _lclkMask, HIGH);               //latch in ports 1 to 6
+    fastWrite(_outmdReg, _outmdMask, LOW);              //Exit output mode
+    _shifts++;
+}
+
+void MuxShield::shiftPort(int mux)                             // added to reduce code repetition in write functions above
+{
+    volatile uint8_t *sclk = _sclkReg[mux-1];
+    volatile uint8_t *io = _ioReg[mux-1];
+    uint8_t sclkMask = _sclkMask[mux-1];
+    uint8_t ioMask = _ioMask[mux-1];
+    unsigned int val = (_latched[mux-1] & ~_pwmMask[mux-1]) | (_pwmBits[mux-1] & _pwmMask[mux-1]);
+    uint8_t sclkLow, sclkHigh, ioLow, ioHigh;
+    byte i;
+
+    if (sclk == io) {                                   //clock and data on one register, read-modify-write each bit
+        for (i=0; i<16; i++) {
+            *sclk &= ~sclkMask;
+            fastWrite(io, ioMask, val & 0x8000);
+            *sclk |= sclkMask;
+            val <<= 1;
+        }
+        return;
+    }
+
+    sclkLow = *sclk & ~sclkMask;                        //register values worked out once, no other write to these
+    sclkHigh = sclkLow | sclkMask;                      //registers can land mid shift: interrupts keep off while _busy
+    ioLow = *io & ~ioMask;
+    ioHigh = ioLow | ioMask;
+
+    for (i=0; i<16; i++) {                              //MSB first, three stores and a 1 bit shift per bit
+        *sclk = sclkLow;                                //sclk of port
+        *io = (val & 0x8000) ? ioHigh : ioLow;          //put value
+        *sclk = sclkHigh;                               //latch in value
+        val <<= 1;
+    }
 }
 
 void MuxShield::setAddress(int mux, int chan)            // added to reduce code repetition in read functions below
@@ -368,6 +557,7 @@ int MuxShield::digitalReadMS(int mux, int chan)         // modified to accept re
 
     if(chan>=0 && chan<CHANNELS){                       // added error handling if invalid input
     
+        beginAccess();
         digitalWrite(_OUTMD,LOW);                       //Set outmode off (i.e. set as input mode)
         setAddress(mux, chan);
 
@@ -407,6 +597,7 @@ int MuxShield::digitalReadMS(int mux, int chan)         // modified to accept re
             default:
                 break;
         }
+        endAccess();
     }
     
     if (val==0) val=1; else if (val==1) val=0;
@@ -420,6 +611,7 @@ int MuxShield::analogReadMS(int mux, int chan)
     
     if(chan>=0 && chan<CHANNELS){                       // added error handling if invalid input
 
+        beginAccess();
         digitalWrite(_OUTMD,LOW);
         setAddress(mux, chan);
 
@@ -459,7 +651,82 @@ int MuxShield::analogReadMS(int mux, int chan)
             default:
                 break;
         }
-        
+        endAccess();
     }
     return val;
-}
\ No newline at end of file
+}
+
+unsigned int MuxShield::digitalReadPortMS(int mux)             // added to read all 16 channels of a port into one word
+{
+    unsigned int val = 0;
+    
+    for (int chan=0; chan<CHANNELS; chan++){
+        if (digitalReadMS(mux, chan) == 1) val |= (1u << chan);
+    }
+    return val;
+}
+
+boolean MuxShield::tryReadPortsMS(unsigned int *vals, int muxMask)     // added for timer interrupt, the foreground may own the lines
+{
+    int chan, mux;
+    byte bits, shifts;
+    
+    if (_busy) return false;
+    
+    for (mux=1; mux<=PORTS; mux++){
+        if (muxMask & (1 << (mux-1))) vals[mux-1] = 0;
+    }
+    
+    for (chan=0; chan<CHANNELS; chan++){
+        do {                                            // the PWM interrupt may shift the ports in between
+            shifts = _shifts;
+            bits = readChannel(chan, muxMask);
+        } while (shifts != _shifts);
+        
+        for (mux=1; mux<=PORTS; mux++){
+            if (bits & (1 << (mux-1))) vals[mux-1] |= (1u << chan);
+        }
+    }
+    return true;
+}
+
+void MuxShield::digitalReadPortsMS(unsigned int *vals, int muxMask)  // added to read several ports in one sweep of the address buss
+{
+    int chan, mux;
+    byte bits;
+    
+    for (mux=1; mux<=PORTS; mux++){
+        if (muxMask & (1 << (mux-1))) vals[mux-1] = 0;
+    }
+    
+    beginAccess();
+    for (chan=0; chan<CHANNELS; chan++){
+        bits = readChannel(chan, muxMask);
+        for (mux=1; mux<=PORTS; mux++){
+            if (bits & (1 << (mux-1))) vals[mux-1] |= (1u << chan);
+        }
+    }
+    endAccess();
+}
+
+byte MuxShield::readChannel(int chan, int muxMask)     // one channel of the ports in muxMask, bit 0 = port 1
+{
+    byte bits = 0;
+    int mux;
+    
+    fastWrite(_outmdReg, _outmdMask, LOW);
+    fastWrite(_sclkReg[0], _sclkMask[0], chan & 1);             // ADDR0-2 for ports 1,2,3
+    fastWrite(_sclkReg[1], _sclkMask[1], (chan >> 1) & 1);
+    fastWrite(_sclkReg[2], _sclkMask[2], (chan >> 2) & 1);
+    if(PORTS==6){
+        fastWrite(_sclkReg[3], _sclkMask[3], chan & 1);         // ADDR0-2 for ports 4,5,6
+        fastWrite(_sclkReg[4], _sclkMask[4], (chan >> 1) & 1);
+        fastWrite(_sclkReg[5], _sclkMask[5], (chan >> 2) & 1);
+    }
+    fastWrite(_lclkReg, _lclkMask, (chan >> 3) & 1);            // ADDR3 for all ports
+    
+    for (mux=1; mux<=PORTS; mux++){
+        if ((muxMask & (1 << (mux-1))) && !(*_ioInReg[mux-1] & _ioMask[mux-1])) bits |= (1 << (mux-1));
+    }
+    return bits;
+}
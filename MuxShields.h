@@ -9,6 +9,8 @@ Modifications by Jim French, March 2016
 #ifndef MuxShields_h
 #define MuxShields_h
 
+#include <Arduino.h>
+
 #define DIGITAL_IN 0
 #define DIGITAL_OUT 1
 #define ANALOG_IN 2
@@ -34,6 +36,20 @@ public:
     int digitalReadMS(int mux, int chan);
     int analogReadMS(int mux, int chan);    
     
+    void digitalWritePortMS(int mux, unsigned int val);         // added to write a whole port with one latch
+    unsigned int getPortMS(int mux);                            // added to return last word written to port
+    unsigned int digitalReadPortMS(int mux);                    // added to read a whole port, bit n = channel n
+    void digitalReadPortsMS(unsigned int *vals, int muxMask);   // added to read the ports in muxMask (bit 0 = port 1) in one sweep
+    boolean tryReadPortsMS(unsigned int *vals, int muxMask);    // added, safe to call from an interrupt, false if the lines are in use
+    
+    void beginBatchMS();                                        // added to collect writes until endBatchMS()
+    void endBatchMS();                                          // added to shift all ports written since beginBatchMS() at once
+    
+    void setPWMMask(int mux, unsigned int mask);                // added to let a PWM engine drive the channels in mask
+    boolean refreshPWM(const unsigned int *bits, int muxMask);  // added for use from a timer interrupt, one word per port in muxMask, lowest first
+    boolean digitalWriteBitsMS(int mux, unsigned int setMask, unsigned int clearMask);  // added, safe to call from an interrupt
+    boolean digitalWritePortsMS(const unsigned int *vals, int muxMask);                 // added, safe to call from an interrupt
+    
 private:
     int _S0, _S1, _S2;
     int _S3;
@@ -43,7 +59,24 @@ private:
     int _IO1, _IO2, _IO3;
     int _IO4, _IO5, _IO6;                       // added for I/O ports 4,5,6
         
+    volatile uint8_t *_sclkReg[6];                      // added for fast shift path, cached port registers and bit masks
+    volatile uint8_t *_ioReg[6];
+    volatile uint8_t *_ioInReg[6];
+    uint8_t _sclkMask[6];
+    uint8_t _ioMask[6];
+    volatile uint8_t *_lclkReg, *_outmdReg;
+    uint8_t _lclkMask, _outmdMask;
+        
     void setAddress(int mux, int chan);                  // added to reduce code repetition 
+    byte readChannel(int chan, int muxMask);
+    void cacheRegisters();
+    void beginAccess();                                  // added to keep the PWM interrupt off the lines while in use
+    void endAccess();
+    void beginShift();
+    void endShift();
+    void shiftPort(int mux);                             // added to reduce code repetition
+    boolean refreshPorts(byte ports);
+    void shiftPendingPorts();
     
 };
 
@@ -0,0 +1,187 @@
+/*
+MuxTimer.cpp - Timer wheel driven by a Timer2 compare interrupt.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * Timer2 runs in CTC mode with a /8 prescaler and OCR2A = 199, one tick every 100uS.
+ * A timer due in d ticks goes into slot (now + d) & (TIMER_SLOTS - 1) with (d - 1) / TIMER_SLOTS
+ * rounds to wait, so it expires exactly d ticks after it was scheduled.
+ * Anything that holds interrupts off for longer than a tick, SendOnlySoftwareSerial keeps them
+ * off for a whole character (about 0.5mS at 19200 baud), loses compare matches. Each interrupt
+ * therefore counts the time since the one before on Timer0, which the core runs at clk/64 and
+ * which wraps only every 1.024mS, and runs as many ticks as have passed. Pulses and sample
+ * clocks stay on time as long as nothing holds interrupts off for a full millisecond.
+ * A callback handed to later() runs after the wheel with Timer2's own interrupt masked and the
+ * others enabled, so it can't be entered twice, and the ticks it spans are caught up the same way.
+ */
+
+#include <Arduino.h>
+#include <avr/interrupt.h>
+
+#include "MuxTimer.h"
+
+
+MuxTimer::MuxTimer()
+{
+    byte i;
+    
+    for (i = 0; i < TIMER_SLOTS; i++) _wheel[i] = TIMER_NONE;
+    for (i = 0; i < TIMER_MAX; i++){
+        _timers[i].callback = 0;
+        _timers[i].next = (i + 1 < TIMER_MAX) ? i + 1 : TIMER_NONE;
+    }
+    _free = 0;
+    _ticks = 0;
+    _t0 = 0;
+    _lag = 0;
+    _later = 0;
+    _laterArg = 0;
+}
+
+void MuxTimer::begin(void)
+{
+    uint8_t oldSREG = SREG;
+    cli();
+    TCCR2A = _BV(WGM21);                        // CTC on OCR2A
+    TCCR2B = _BV(CS21);                         // clk/8
+    OCR2A = (F_CPU / 8 / 1000000L) * TIMER_TICK_US - 1;
+    TCNT2 = 0;
+    _t0 = TCNT0;
+    _lag = TIMER_T0_COUNTS / 2;                 // centred, so interrupt latency jitter never adds or drops a tick
+    TIMSK2 |= _BV(OCIE2A);
+    SREG = oldSREG;
+}
+
+byte MuxTimer::schedule(unsigned long ticks, timerCallbackFunction newFunction, byte arg)
+{
+    byte id;
+    
+    if (ticks == 0) ticks = 1;
+    
+    uint8_t oldSREG = SREG;
+    cli();
+    
+    id = _free;
+    if (id != TIMER_NONE){
+        _free = _timers[id].next;
+        
+        _timers[id].callback = newFunction;
+        _timers[id].arg = arg;
+        _timers[id].rounds = (ticks - 1) / TIMER_SLOTS;
+        _timers[id].slot = (_ticks + ticks) & (TIMER_SLOTS - 1);
+        _timers[id].next = _wheel[_timers[id].slot];
+        _wheel[_timers[id].slot] = id;
+    }
+    
+    SREG = oldSREG;
+    return id;
+}
+
+void MuxTimer::cancel(byte id)
+{
+    byte *link;
+    
+    if (id >= TIMER_MAX) return;
+    
+    uint8_t oldSREG = SREG;
+    cli();
+    
+    if (_timers[id].callback){
+        for (link = &_wheel[_timers[id].slot]; *link != TIMER_NONE; link = &_timers[*link].next){
+            if (*link == id){
+                *link = _timers[id].next;
+                _timers[id].callback = 0;
+                _timers[id].next = _free;
+                _free = id;
+                break;
+            }
+        }
+    }
+    
+    SREG = oldSREG;
+}
+
+boolean MuxTimer::later(timerCallbackFunction newFunction, byte arg)
+{
+    if (_later) return false;
+    
+    _later = newFunction;
+    _laterArg = arg;
+    return true;
+}
+
+unsigned long MuxTimer::getTicks(void)
+{
+    unsigned long ticks;
+    
+    uint8_t oldSREG = SREG;
+    cli();
+    ticks = _ticks;
+    SREG = oldSREG;
+    
+    return ticks;
+}
+
+void MuxTimer::tick(void)
+{
+    byte now = TCNT0;
+    
+    _lag += (byte)(now - _t0);
+    _t0 = now;
+    
+    while (_lag >= TIMER_T0_COUNTS){            // one tick normally, more after interrupts were held off
+        _lag -= TIMER_T0_COUNTS;
+        step();
+    }
+    
+    if (_later){
+        timerCallbackFunction callback = _later;
+        
+        _later = 0;
+        TIMSK2 &= ~_BV(OCIE2A);
+        sei();                                  // Timer1, Timer0 and the UART may come in from here
+        (*callback)(_laterArg);
+        cli();
+        TIMSK2 |= _BV(OCIE2A);
+    }
+}
+
+void MuxTimer::step(void)
+{
+    byte slot, id, next;
+    timerCallbackFunction callback;
+    
+    _ticks++;
+    slot = _ticks & (TIMER_SLOTS - 1);
+    
+    id = _wheel[slot];                          // take the whole slot so timers rescheduled by callbacks wait a turn
+    _wheel[slot] = TIMER_NONE;
+    
+    while (id != TIMER_NONE){
+        next = _timers[id].next;
+        
+        if (_timers[id].rounds){
+            _timers[id].rounds--;
+            _timers[id].next = _wheel[slot];
+            _wheel[slot] = id;
+        }
+        else {
+            callback = _timers[id].callback;
+            _timers[id].callback = 0;
+            _timers[id].next = _free;
+            _free = id;
+            (*callback)(_timers[id].arg);
+        }
+        id = next;
+    }
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+    Timers.tick();
+}
+
+// make one instance for the timer interrupt to use
+MuxTimer Timers;
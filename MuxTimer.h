@@ -0,0 +1,70 @@
+/*
+MuxTimer.h - Timer wheel driven by a Timer2 compare interrupt.
+One shot timers are kept in a hashed wheel so each tick only visits the timers
+due in one slot. Callbacks run in interrupt context and may reschedule themselves.
+Long work can be handed to later(), which runs it at the end of the same interrupt
+with interrupts enabled so the other timers and the UART are not held off by it.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef MuxTimer_h
+#define MuxTimer_h
+
+#include <inttypes.h>
+
+#include <Arduino.h>
+
+#define TIMER_TICK_US 100               // wheel resolution (uS)
+#define TIMER_SLOTS 16                  // wheel slots, must be a power of 2
+#define TIMER_MAX 8                     // timers available at once (4 pulses, sequencer, 2 sample clocks and a retry),
+                                        // 9 bytes of RAM each. A full wheel fails schedule() with TIMER_NONE
+#define TIMER_NONE 0xFF                 // returned when no timer is free
+#define TIMER_T0_COUNTS (F_CPU / 64 * TIMER_TICK_US / 1000000L)     // Timer0 counts per tick, the core runs it at clk/64
+
+extern "C" {
+    typedef void (*timerCallbackFunction)(byte arg);
+}
+
+class MuxTimer {
+
+public:
+    MuxTimer();
+
+    void begin(void);
+    byte schedule(unsigned long ticks, timerCallbackFunction newFunction, byte arg);
+    void cancel(byte id);
+    boolean later(timerCallbackFunction newFunction, byte arg);    // from a callback only, false if one is already waiting
+    unsigned long getTicks(void);
+
+    static unsigned long msToTicks(unsigned long ms) { return ms * (1000 / TIMER_TICK_US); }
+    static unsigned long usToTicks(unsigned long us) { return (us + TIMER_TICK_US / 2) / TIMER_TICK_US; }
+
+    void tick(void);                            // called from the timer interrupt only
+
+private:
+    void step(void);
+
+    struct timer {
+        timerCallbackFunction callback;
+        unsigned long rounds;                   // full turns of the wheel left before expiry
+        byte arg;
+        byte slot;
+        byte next;                              // next timer in the same slot, or in the free list
+    };
+
+    timer _timers[TIMER_MAX];
+    byte _wheel[TIMER_SLOTS];                   // first timer in each slot
+    byte _free;                                 // first unused timer
+    volatile unsigned long _ticks;
+    byte _t0;                                   // TCNT0 at the last interrupt
+    unsigned int _lag;                          // Timer0 counts not yet turned into ticks
+    timerCallbackFunction _later;               // run by tick() once the wheel is done
+    byte _laterArg;
+};
+
+extern MuxTimer Timers;
+
+#endif
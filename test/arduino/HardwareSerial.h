@@ -0,0 +1,31 @@
+/*
+HardwareSerial.h - Host stand-in for the Arduino core's Serial, declared only so the
+sources that name it still build. Nothing on the host drives it.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include "Stream.h"
+
+class HardwareSerial : public Stream {
+
+public:
+    void begin(unsigned long baud);
+    void end(void);
+    int available(void);
+    int peek(void);
+    int read(void);
+    int availableForWrite(void);
+    size_t write(uint8_t c);
+    using Print::write;
+    operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,17 @@
+/*
+avr/interrupt.h - Host stand-in, an interrupt handler is a plain function a test can call.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef interrupt_h
+#define interrupt_h
+
+void cli(void);
+void sei(void);
+
+#define ISR(vector) extern "C" void vector(void)
+
+#endif
@@ -0,0 +1,87 @@
+/*
+host.cpp - Host stand-in for the parts of the Arduino core the modules under test call.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#include <chrono>
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+
+volatile uint8_t SREG;
+volatile uint8_t UCSR0A, UCSR0B, UCSR0C, UDR0, UBRR0H, UBRR0L;
+
+static uint8_t eeprom[E2END + 1];
+static std::chrono::steady_clock::time_point const started = std::chrono::steady_clock::now();
+
+
+void cli(void) {}
+void sei(void) {}
+
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return LOW; }
+int analogRead(uint8_t) { return 0; }
+
+unsigned long micros(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+unsigned long millis(void)
+{
+    return micros() / 1000;
+}
+
+void delay(unsigned long ms)
+{
+    unsigned long start = micros();
+
+    while (micros() - start < ms * 1000) ;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    unsigned long start = micros();
+
+    while (micros() - start < us) ;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+    size_t count = 0;
+    int c;
+
+    while (count < length && (c = read()) >= 0) buffer[count++] = c;
+    return count;
+}
+
+
+uint8_t eeprom_read_byte(const uint8_t *addr) { return eeprom[(uintptr_t)addr & E2END]; }
+void eeprom_update_byte(uint8_t *addr, uint8_t value) { eeprom[(uintptr_t)addr & E2END] = value; }
+
+uint32_t eeprom_read_dword(const uint32_t *addr)
+{
+    uint32_t value;
+
+    eeprom_read_block(&value, addr, sizeof(value));
+    return value;
+}
+
+void eeprom_update_dword(uint32_t *addr, uint32_t value)
+{
+    eeprom_update_block(&value, addr, sizeof(value));
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) ((uint8_t *)dst)[i] = eeprom[((uintptr_t)src + i) & E2END];
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+    for (size_t i = 0; i < n; i++) eeprom[((uintptr_t)dst + i) & E2END] = ((const uint8_t *)src)[i];
+}
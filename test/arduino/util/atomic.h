@@ -0,0 +1,15 @@
+/*
+util/atomic.h - Host stand-in, the block runs once with nothing to protect it from.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef atomic_h
+#define atomic_h
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_BLOCK(type) for (int _done = 0; !_done; _done = 1)
+
+#endif
@@ -0,0 +1,200 @@
+/*
+bench_dispatch.cpp - Host microbenchmark of Firmata's channel command dispatch.
+Runs the same message stream through the switch based parser FirmataClass had before the
+callback table, through parse(byte) and through the bulk parse(buffer, length), checks
+that all three make the same callbacks and prints the cost per message.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * The stream holds the six table commands in a fixed pseudo random mix, with a run of stray
+ * data bytes now and then that must be ignored. The host is not an AVR, so only the ratio
+ * between the parsers means anything, the absolute times do not.
+ */
+
+#include <chrono>
+#include <stdio.h>
+
+#include "Firmata.h"
+
+#define BENCH_MESSAGES 10000
+#define BENCH_ROUNDS 200
+
+static byte stream[BENCH_MESSAGES * 3];
+static size_t streamLength = 0;
+static unsigned long messages = 0;
+static unsigned long sum = 0;
+
+
+static void record(unsigned long kind, byte channel, int value)
+{
+    sum = sum * 31 + (kind << 24) + (channel << 16) + (unsigned int)value;
+}
+
+extern "C" {
+    static void analogCallback(byte channel, int value) { record(1, channel, value); }
+    static void digitalCallback(byte port, int value) { record(2, port, value); }
+    static void reportAnalogCallback(byte channel, int value) { record(3, channel, value); }
+    static void reportDigitalCallback(byte port, int value) { record(4, port, value); }
+    static void pinModeCallback(byte pin, int mode) { record(5, pin, mode); }
+    static void pinValueCallback(byte pin, int value) { record(6, pin, value); }
+}
+
+
+// parse(byte) as it was before the callback table, sysex and the 0xF* commands left out
+class SwitchParser {
+
+public:
+    SwitchParser() : waitForData(0), executeMultiByteCommand(0), multiByteChannel(0) {}
+
+    void parse(byte inputData);
+
+    callbackFunction currentAnalogCallback = analogCallback;
+    callbackFunction currentDigitalCallback = digitalCallback;
+    callbackFunction currentReportAnalogCallback = reportAnalogCallback;
+    callbackFunction currentReportDigitalCallback = reportDigitalCallback;
+    callbackFunction currentPinModeCallback = pinModeCallback;
+    callbackFunction currentPinValueCallback = pinValueCallback;
+
+private:
+    int waitForData;
+    int executeMultiByteCommand;
+    byte multiByteChannel;
+    byte storedInputData[2];
+};
+
+void SwitchParser::parse(byte inputData)
+{
+    int command;
+
+    if ( (waitForData > 0) && (inputData < 128) ) {
+        waitForData--;
+        storedInputData[waitForData] = inputData;
+        if ( (waitForData == 0) && executeMultiByteCommand ) {
+            switch (executeMultiByteCommand) {
+                case ANALOG_MESSAGE:
+                    if (currentAnalogCallback) {
+                        (*currentAnalogCallback)(multiByteChannel, (storedInputData[0] << 7) + storedInputData[1]);
+                    }
+                    break;
+                case DIGITAL_MESSAGE:
+                    if (currentDigitalCallback) {
+                        (*currentDigitalCallback)(multiByteChannel, (storedInputData[0] << 7) + storedInputData[1]);
+                    }
+                    break;
+                case SET_PIN_MODE:
+                    if (currentPinModeCallback)
+                        (*currentPinModeCallback)(storedInputData[1], storedInputData[0]);
+                    break;
+                case SET_DIGITAL_PIN_VALUE:
+                    if (currentPinValueCallback)
+                        (*currentPinValueCallback)(storedInputData[1], storedInputData[0]);
+                    break;
+                case REPORT_ANALOG:
+                    if (currentReportAnalogCallback)
+                        (*currentReportAnalogCallback)(multiByteChannel, storedInputData[0]);
+                    break;
+                case REPORT_DIGITAL:
+                    if (currentReportDigitalCallback)
+                        (*currentReportDigitalCallback)(multiByteChannel, storedInputData[0]);
+                    break;
+            }
+            executeMultiByteCommand = 0;
+        }
+    } else {
+        if (inputData < 0xF0) {
+            command = inputData & 0xF0;
+            multiByteChannel = inputData & 0x0F;
+        } else {
+            command = inputData;
+        }
+        switch (command) {
+            case ANALOG_MESSAGE:
+            case DIGITAL_MESSAGE:
+            case SET_PIN_MODE:
+            case SET_DIGITAL_PIN_VALUE:
+                waitForData = 2;
+                executeMultiByteCommand = command;
+                break;
+            case REPORT_ANALOG:
+            case REPORT_DIGITAL:
+                waitForData = 1;
+                executeMultiByteCommand = command;
+                break;
+        }
+    }
+}
+
+
+static void buildStream(void)
+{
+    static const byte commands[] = {ANALOG_MESSAGE, ANALOG_MESSAGE, ANALOG_MESSAGE, DIGITAL_MESSAGE,
+                                    SET_DIGITAL_PIN_VALUE, SET_PIN_MODE, REPORT_ANALOG, REPORT_DIGITAL};
+    unsigned long seed = 12345;
+    byte command;
+
+    for (unsigned long i = 0; i < BENCH_MESSAGES; i++){
+        seed = seed * 1103515245 + 12345;
+        command = commands[(seed >> 16) & 7];
+
+        if (((seed >> 8) & 63) == 0){
+            stream[streamLength++] = 0x40 | ((seed >> 20) & 0x1F);     // stray data bytes, the first in a command slot's range
+            stream[streamLength++] = (seed >> 4) & 0x7F;
+            stream[streamLength++] = (seed >> 12) & 0x7F;
+            continue;
+        }
+        messages++;
+        if (command < 0xF0) stream[streamLength++] = command | ((seed >> 20) & 0x0F);
+        else stream[streamLength++] = command;
+        stream[streamLength++] = (seed >> 4) & 0x7F;
+        if (command != REPORT_ANALOG && command != REPORT_DIGITAL) stream[streamLength++] = (seed >> 12) & 0x7F;
+    }
+}
+
+// ns per message, best of BENCH_ROUNDS passes over the stream
+template <typename Pass> static double measure(Pass pass, unsigned long *result)
+{
+    double best = 1e30, ns;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++){
+        sum = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        pass();
+        ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (ns < best) best = ns;
+    }
+    *result = sum;
+    return best / messages;
+}
+
+int main(void)
+{
+    SwitchParser legacy;
+    unsigned long legacySum, byteSum, bulkSum;
+    double legacyNs, byteNs, bulkNs;
+
+    buildStream();
+
+    Firmata.attach(ANALOG_MESSAGE, analogCallback);
+    Firmata.attach(DIGITAL_MESSAGE, digitalCallback);
+    Firmata.attach(REPORT_ANALOG, reportAnalogCallback);
+    Firmata.attach(REPORT_DIGITAL, reportDigitalCallback);
+    Firmata.attach(SET_PIN_MODE, pinModeCallback);
+    Firmata.attach(SET_DIGITAL_PIN_VALUE, pinValueCallback);
+
+    legacyNs = measure([&]{ for (size_t i = 0; i < streamLength; i++) legacy.parse(stream[i]); }, &legacySum);
+    byteNs = measure([&]{ for (size_t i = 0; i < streamLength; i++) Firmata.parse(stream[i]); }, &byteSum);
+    bulkNs = measure([&]{ Firmata.parse(stream, streamLength); }, &bulkSum);
+
+    printf("%lu messages, %lu bytes, best of %d passes\n", messages, (unsigned long)streamLength, BENCH_ROUNDS);
+    printf("switch parse(byte)         %6.2f ns/message\n", legacyNs);
+    printf("table parse(byte)          %6.2f ns/message  %.2fx\n", byteNs, legacyNs / byteNs);
+    printf("table parse(buffer, len)   %6.2f ns/message  %.2fx\n", bulkNs, legacyNs / bulkNs);
+
+    if (byteSum != legacySum || bulkSum != legacySum){
+        printf("FAIL: the parsers made different callbacks\n");
+        return 1;
+    }
+    return 0;
+}
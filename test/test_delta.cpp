@@ -0,0 +1,297 @@
+/*
+test_delta.cpp - Host tests for the delta encoded analogue stream: muxPackDelta(),
+muxUnpackDelta() and the MuxAnalogStream reference decoder.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * Covers the zigzag extremes of a 10 bit reading, every width class and its edges, the packed
+ * size, keyframes alternating with deltas as the firmware sends them, and the resync after a
+ * lost packet, through MuxFrameEncoder and MuxFrameDecoder as a host would see it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "MuxFraming.h"
+
+#define CHANNELS 16
+#define KEYFRAME_EVERY 8
+
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char *what, int line)
+{
+    if (!ok){
+        printf("FAIL line %d: %s\n", line, what);
+        failures++;
+    }
+}
+
+static unsigned long seed = 7;
+
+static int random10(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x3FF;
+}
+
+// bits muxPackDelta() spends on one change: the size then the zigzag value
+static unsigned int deltaBits(int delta)
+{
+    unsigned int zigzag = (delta < 0) ? (-delta) * 2 - 1 : delta * 2;
+
+    if (zigzag == 0) return 2;
+    if (zigzag < 4) return 2 + 2;
+    if (zigzag < 32) return 2 + 5;
+    return 2 + 11;
+}
+
+// packs values against previous, unpacks it against a copy and checks both sides
+static void roundTrip(const int *values, const int *before, uint8_t count)
+{
+    int previous[CHANNELS], decoded[CHANNELS];
+    uint8_t packed[MUX_DELTA_BYTES(CHANNELS) + 1];
+    unsigned int bits = 0;
+    size_t length;
+
+    memcpy(previous, before, count * sizeof(int));
+    memcpy(decoded, before, count * sizeof(int));
+    memset(packed, 0xAA, sizeof(packed));
+
+    length = muxPackDelta(values, previous, count, packed);
+    for (uint8_t i = 0; i < count; i++) bits += deltaBits(values[i] - before[i]);
+
+    CHECK(length == (bits + 7) / 8);
+    CHECK(length <= (size_t)MUX_DELTA_BYTES(count));
+    CHECK(packed[length] == 0xAA);                          // nothing written past the end
+    CHECK(memcmp(previous, values, count * sizeof(int)) == 0);
+
+    muxUnpackDelta(packed, count, decoded);
+    CHECK(memcmp(decoded, values, count * sizeof(int)) == 0);
+}
+
+
+static void testExtremes(void)
+{
+    int low[CHANNELS], high[CHANNELS], mixed[CHANNELS];
+
+    for (uint8_t i = 0; i < CHANNELS; i++){
+        low[i] = 0;
+        high[i] = 1023;
+        mixed[i] = (i & 1) ? 1023 : 0;
+    }
+    roundTrip(high, low, CHANNELS);                         // +1023 on every channel, zigzag 2046
+    roundTrip(low, high, CHANNELS);                         // -1023, zigzag 2045
+    roundTrip(mixed, low, CHANNELS);
+    roundTrip(low, mixed, CHANNELS);
+    roundTrip(low, low, CHANNELS);                          // no change, 2 bits a channel
+}
+
+// each class and both sides of its edges: 0 | 1..-2 | 2..15, -3..-16 | the rest
+static void testWidthClasses(void)
+{
+    static const int deltas[] = {0, 1, -1, -2, 2, -3, 15, -16, 16, -17, 100, -100, 511, -512};
+    int before[CHANNELS], values[CHANNELS];
+    size_t n, i;
+
+    for (n = 0; n < sizeof(deltas) / sizeof(deltas[0]); n++){
+        for (i = 0; i < CHANNELS; i++){
+            before[i] = 512;
+            values[i] = 512 + deltas[n];
+        }
+        roundTrip(values, before, CHANNELS);
+        roundTrip(values, before, 1);
+        roundTrip(values, before, 3);                       // odd bit counts, the last byte is partial
+    }
+
+    for (i = 0; i < CHANNELS; i++){                         // every class in one sweep
+        before[i] = 512;
+        values[i] = 512 + deltas[i % (sizeof(deltas) / sizeof(deltas[0]))];
+    }
+    roundTrip(values, before, CHANNELS);
+
+    for (n = 0; n < 1000; n++){
+        for (i = 0; i < CHANNELS; i++){
+            before[i] = random10();
+            values[i] = random10();
+        }
+        roundTrip(values, before, CHANNELS);
+    }
+}
+
+
+// what sendAnalogPacket() does: a keyframe, then deltas until the next keyframe is due
+class Sender {
+
+public:
+    Sender() : sequence(0), count(0) { memset(previous, 0, sizeof(previous)); }
+
+    size_t send(const int *values, uint8_t *out)
+    {
+        MuxFrameEncoder encoder(out, MUX_FRAME_ENCODED(MUX_DELTA_BYTES(CHANNELS)));
+        uint8_t payload[MUX_DELTA_BYTES(CHANNELS)];
+        size_t length;
+        uint8_t type;
+
+        if (count){
+            length = muxPackDelta(values, previous, CHANNELS, payload);
+            type = MUX_FRAME_ANALOG_DELTA;
+        }
+        else {
+            memcpy(previous, values, sizeof(previous));
+            length = muxPackAnalog(values, CHANNELS, payload);
+            type = MUX_FRAME_ANALOG;
+        }
+        if (++count >= KEYFRAME_EVERY) count = 0;
+
+        encoder.begin(type, sequence++);
+        for (size_t i = 0; i < length; i++) encoder.put(payload[i]);
+        return encoder.end();
+    }
+
+    uint8_t sequence;
+    uint8_t count;
+    int previous[CHANNELS];
+};
+
+// feeds a packet through the decoder into the stream, true if the stream's values changed
+static bool receive(MuxFrameDecoder &decoder, MuxAnalogStream &stream, const uint8_t *data, size_t length)
+{
+    bool applied = false;
+
+    for (size_t i = 0; i < length; i++){
+        if (decoder.feed(data[i])) applied = stream.apply(decoder.type(), decoder.sequence(), decoder.payload(), decoder.length());
+    }
+    return applied;
+}
+
+// a slowly drifting sweep with some noise and the odd jump
+static void nextSweep(int *values)
+{
+    for (uint8_t i = 0; i < CHANNELS; i++){
+        values[i] += (random10() & 3) - 1;
+        if ((random10() & 63) == 0) values[i] = random10();
+        if (values[i] < 0) values[i] = 0;
+        if (values[i] > 1023) values[i] = 1023;
+    }
+}
+
+static void testKeyframesAndDeltas(void)
+{
+    MuxFrameDecoder decoder;
+    MuxAnalogStream stream(CHANNELS);
+    Sender sender;
+    uint8_t out[MUX_FRAME_ENCODED(MUX_DELTA_BYTES(CHANNELS))];
+    int values[CHANNELS];
+    size_t length, deltaBytes = 0, keyBytes = 0, deltas = 0, keys = 0;
+
+    for (uint8_t i = 0; i < CHANNELS; i++) values[i] = 300 + i * 40;
+
+    for (int sweep = 0; sweep < 400; sweep++){
+        nextSweep(values);
+        length = sender.send(values, out);
+        CHECK(length > 0 && out[length - 1] == 0);
+
+        CHECK(receive(decoder, stream, out, length));
+        CHECK(stream.synced());
+        CHECK(memcmp(stream.values, values, sizeof(values)) == 0);
+
+        if (sweep % KEYFRAME_EVERY){ deltas++; deltaBytes += length; }
+        else { keys++; keyBytes += length; }
+    }
+    CHECK(stream.resyncs == 0 && decoder.lost == 0);
+    CHECK(deltaBytes * keys < keyBytes * deltas);           // a quiet stream is cheaper in deltas
+}
+
+static void testResync(void)
+{
+    MuxFrameDecoder decoder;
+    MuxAnalogStream stream(CHANNELS);
+    Sender sender;
+    uint8_t out[MUX_FRAME_ENCODED(MUX_DELTA_BYTES(CHANNELS))];
+    int values[CHANNELS], held[CHANNELS];
+    size_t length;
+    int sweep;
+
+    for (uint8_t i = 0; i < CHANNELS; i++) values[i] = 512;
+
+    for (sweep = 0; sweep < 3; sweep++){                    // keyframe and two deltas
+        nextSweep(values);
+        length = sender.send(values, out);
+        CHECK(receive(decoder, stream, out, length));
+    }
+
+    nextSweep(values);                                      // a delta is lost on the wire
+    sender.send(values, out);
+    memcpy(held, stream.values, sizeof(held));
+
+    for (sweep = 4; sweep < KEYFRAME_EVERY; sweep++){       // the deltas after it are refused
+        nextSweep(values);
+        length = sender.send(values, out);
+        CHECK(!receive(decoder, stream, out, length));
+        CHECK(!stream.synced());
+        CHECK(memcmp(stream.values, held, sizeof(held)) == 0);
+    }
+    CHECK(stream.resyncs == 1);
+    CHECK(decoder.lost == 1);
+
+    nextSweep(values);                                      // the next keyframe brings it back
+    length = sender.send(values, out);
+    CHECK(receive(decoder, stream, out, length));
+    CHECK(stream.synced());
+    CHECK(memcmp(stream.values, values, sizeof(values)) == 0);
+
+    nextSweep(values);
+    length = sender.send(values, out);
+    CHECK(receive(decoder, stream, out, length));
+    CHECK(memcmp(stream.values, values, sizeof(values)) == 0);
+    CHECK(stream.resyncs == 1);
+}
+
+// a corrupted delta is dropped by the decoder, and the stream sees the gap at the next packet
+static void testCorruptDelta(void)
+{
+    MuxFrameDecoder decoder;
+    MuxAnalogStream stream(CHANNELS);
+    Sender sender;
+    uint8_t out[MUX_FRAME_ENCODED(MUX_DELTA_BYTES(CHANNELS))];
+    int values[CHANNELS];
+    size_t length;
+
+    for (uint8_t i = 0; i < CHANNELS; i++) values[i] = 100;
+
+    for (int sweep = 0; sweep < 2; sweep++){
+        nextSweep(values);
+        length = sender.send(values, out);
+        CHECK(receive(decoder, stream, out, length));
+    }
+    nextSweep(values);
+    length = sender.send(values, out);
+    out[length / 2] ^= (out[length / 2] == 0x10) ? 0x20 : 0x10;
+    CHECK(!receive(decoder, stream, out, length));
+    CHECK(decoder.crcErrors + decoder.framingErrors > 0);
+    CHECK(stream.synced());                                 // nothing reached it yet
+
+    nextSweep(values);
+    length = sender.send(values, out);
+    CHECK(!receive(decoder, stream, out, length));
+    CHECK(!stream.synced() && stream.resyncs == 1);
+}
+
+
+int main(void)
+{
+    testExtremes();
+    testWidthClasses();
+    testKeyframesAndDeltas();
+    testResync();
+    testCorruptDelta();
+
+    if (failures) return 1;
+    printf("test_delta: all passed\n");
+    return 0;
+}
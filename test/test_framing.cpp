@@ -0,0 +1,254 @@
+/*
+test_framing.cpp - Host tests for MuxFraming's packets and for the framed output of Firmata.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * Covers the encoder to decoder round trip, COBS blocks on either side of 254 bytes, CRC
+ * detection of corrupted packets, counting of sequence gaps, and checks that Firmata, which
+ * encodes straight into its output buffer, sends the same bytes as MuxFrameEncoder.
+ */
+
+#include <stdio.h>
+
+#include "Firmata.h"
+#include "MuxFraming.h"
+
+#define TEST_MAX_ENCODED 600
+
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char *what, int line)
+{
+    if (!ok){
+        printf("FAIL line %d: %s\n", line, what);
+        failures++;
+    }
+}
+
+static unsigned long seed = 1;
+
+static uint8_t random8(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+static size_t encode(uint8_t type, uint8_t sequence, const uint8_t *payload, size_t length, uint8_t *out)
+{
+    MuxFrameEncoder encoder(out, TEST_MAX_ENCODED);
+
+    encoder.begin(type, sequence);
+    for (size_t i = 0; i < length; i++) encoder.put(payload[i]);
+    return encoder.end();
+}
+
+// feeds a whole encoded packet, true if it came out as one packet
+static bool feed(MuxFrameDecoder &decoder, const uint8_t *data, size_t length)
+{
+    bool ready = false;
+
+    for (size_t i = 0; i < length; i++) ready = decoder.feed(data[i]);
+    return ready;
+}
+
+// plain COBS decoder, independent of MuxFrameDecoder and without its length limit
+static size_t unstuff(const uint8_t *in, size_t length, uint8_t *out)
+{
+    size_t i = 0, n = 0;
+    uint8_t code;
+
+    while (i < length && in[i]){
+        code = in[i++];
+        for (uint8_t k = 1; k < code; k++) out[n++] = in[i++];
+        if (code != 0xFF && in[i]) out[n++] = 0;
+    }
+    return n;
+}
+
+
+static void testCrc(void)
+{
+    const char *digits = "123456789";
+    uint16_t crc = 0xFFFF;
+
+    for (size_t i = 0; i < strlen(digits); i++) crc = muxFrameCrc(crc, digits[i]);
+    CHECK(crc == 0x29B1);                                   // CRC-16/CCITT-FALSE check value
+}
+
+static void testRoundTrip(void)
+{
+    uint8_t payload[MUX_FRAME_MAX_PACKET], out[TEST_MAX_ENCODED];
+    MuxFrameDecoder decoder;
+    size_t length, encoded, i;
+    uint8_t sequence = 0;
+
+    for (length = 0; length <= MUX_FRAME_MAX_PACKET - MUX_FRAME_HEADER - MUX_FRAME_CRC - 1; length++){
+        for (int pattern = 0; pattern < 3; pattern++){
+            for (i = 0; i < length; i++){
+                payload[i] = pattern == 0 ? 0 : (pattern == 1 ? (i % 255) + 1 : random8());
+            }
+            encoded = encode(MUX_FRAME_ANALOG, sequence, payload, length, out);
+            CHECK(encoded > 0 && encoded <= MUX_FRAME_ENCODED(length));
+            CHECK(out[encoded - 1] == 0);
+            for (i = 0; i + 1 < encoded; i++) if (!out[i]) break;
+            CHECK(i == encoded - 1);                        // the delimiter is the only zero
+
+            CHECK(feed(decoder, out, encoded));
+            CHECK(decoder.type() == MUX_FRAME_ANALOG);
+            CHECK(decoder.sequence() == sequence);
+            CHECK(decoder.length() == length);
+            CHECK(memcmp(decoder.payload(), payload, length) == 0);
+            sequence++;
+        }
+    }
+    CHECK(decoder.crcErrors == 0 && decoder.framingErrors == 0 && decoder.lost == 0);
+}
+
+// runs of non-zero bytes that end just before, at and after a full 254 byte COBS block
+static void testBlockBoundaries(void)
+{
+    static const size_t lengths[] = {249, 250, 251, 252, 253, 254, 255, 504, 505, 506};
+    uint8_t payload[520], out[TEST_MAX_ENCODED], packet[TEST_MAX_ENCODED];
+    MuxFrameDecoder decoder;
+    size_t encoded, decoded, n, i;
+    uint16_t crc;
+
+    for (n = 0; n < sizeof(lengths) / sizeof(lengths[0]); n++){
+        for (i = 0; i < lengths[n]; i++) payload[i] = (i % 254) + 1;
+        encoded = encode(MUX_FRAME_FIRMATA, 0x11, payload, lengths[n], out);
+        CHECK(encoded > 0 && encoded <= MUX_FRAME_ENCODED(lengths[n]));
+
+        decoded = unstuff(out, encoded, packet);
+        CHECK(decoded == lengths[n] + MUX_FRAME_HEADER + MUX_FRAME_CRC);
+        CHECK(packet[0] == MUX_FRAME_FIRMATA && packet[1] == 0x11);
+        CHECK(memcmp(packet + MUX_FRAME_HEADER, payload, lengths[n]) == 0);
+
+        crc = 0xFFFF;
+        for (i = 0; i < decoded - MUX_FRAME_CRC; i++) crc = muxFrameCrc(crc, packet[i]);
+        CHECK(packet[decoded - 2] == (crc & 0xFF) && packet[decoded - 1] == (crc >> 8));
+
+        for (i = 0; i < encoded - 1; i += out[i]) ;
+        CHECK(i == encoded - 1);                            // the code bytes chain to the delimiter
+
+        // longer than the host decoder takes, dropped as a framing error and the next one is fine
+        CHECK(!feed(decoder, out, encoded));
+        encoded = encode(MUX_FRAME_DIGITAL, 1, payload, 4, out);
+        CHECK(feed(decoder, out, encoded));
+    }
+    CHECK(decoder.framingErrors == sizeof(lengths) / sizeof(lengths[0]));
+    CHECK(decoder.crcErrors == 0);
+}
+
+// every single bit flip in a packet is caught, and the decoder picks up the packet after it
+static void testCorruption(void)
+{
+    uint8_t payload[20], out[TEST_MAX_ENCODED], bad[TEST_MAX_ENCODED], next[TEST_MAX_ENCODED];
+    MuxFrameDecoder decoder;
+    size_t encoded, nextLength, i;
+    unsigned long rejected;
+    int bit;
+
+    for (i = 0; i < sizeof(payload); i++) payload[i] = random8();
+    payload[5] = 0;
+    encoded = encode(MUX_FRAME_ANALOG, 7, payload, sizeof(payload), out);
+    nextLength = encode(MUX_FRAME_DIGITAL, 8, payload, 4, next);
+
+    for (i = 0; i < encoded - 1; i++){
+        for (bit = 0; bit < 8; bit++){
+            memcpy(bad, out, encoded);
+            bad[i] ^= 1 << bit;
+            rejected = decoder.crcErrors + decoder.framingErrors;
+
+            CHECK(!feed(decoder, bad, encoded));
+            CHECK(decoder.crcErrors + decoder.framingErrors > rejected);
+            CHECK(feed(decoder, next, nextLength));
+            CHECK(decoder.sequence() == 8 && decoder.length() == 4);
+        }
+    }
+}
+
+static void testSequenceGaps(void)
+{
+    static const uint8_t sequences[] = {0, 1, 2, 5, 6, 250, 255, 0, 1, 3};
+    uint8_t payload[4] = {1, 2, 3, 4}, out[TEST_MAX_ENCODED];
+    MuxFrameDecoder decoder;
+    size_t encoded, i;
+
+    for (i = 0; i < sizeof(sequences); i++){
+        encoded = encode(MUX_FRAME_DIGITAL, sequences[i], payload, sizeof(payload), out);
+        CHECK(feed(decoder, out, encoded));
+    }
+    CHECK(decoder.lost == 2 + 243 + 4 + 1);                 // 3-4, 7-249, 251-254, 2
+    CHECK(decoder.crcErrors == 0 && decoder.framingErrors == 0);
+}
+
+
+// keeps what Firmata writes
+class CaptureStream : public Stream {
+
+public:
+    CaptureStream() : length(0) {}
+
+    int available(void) { return 0; }
+    int peek(void) { return -1; }
+    int read(void) { return -1; }
+    size_t write(uint8_t c)
+    {
+        if (length < sizeof(out)) out[length++] = c;
+        return 1;
+    }
+    using Print::write;
+
+    uint8_t out[1024];
+    size_t length;
+};
+
+static void testFirmataPackets(void)
+{
+    CaptureStream host;
+    uint8_t payload[100], expected[TEST_MAX_ENCODED];
+    size_t encoded, length, at;
+    uint8_t sequence = 0;
+
+    Firmata.begin(host);                                    // announces the protocol version, unframed
+    at = host.length;
+    Firmata.setFramed(true);
+
+    for (length = 0; length < sizeof(payload); length += 7){
+        for (size_t i = 0; i < length; i++) payload[i] = (i % 3 == 0) ? 0 : random8();
+        CHECK(Firmata.sendPacket(MUX_FRAME_ANALOG, payload, length));
+        encoded = encode(MUX_FRAME_ANALOG, sequence++, payload, length, expected);
+        CHECK(host.length == at + encoded);
+        CHECK(memcmp(host.out + at, expected, encoded) == 0);
+        at = host.length;
+    }
+
+    Firmata.sendDigitalPort(1, 0x55);                       // a Firmata message goes out as MUX_FRAME_FIRMATA
+    payload[0] = DIGITAL_MESSAGE | 1;
+    payload[1] = 0x55;
+    payload[2] = 0x00;
+    encoded = encode(MUX_FRAME_FIRMATA, sequence++, payload, 3, expected);
+    CHECK(host.length == at + encoded);
+    CHECK(memcmp(host.out + at, expected, encoded) == 0);
+
+    Firmata.setFramed(false);
+}
+
+
+int main(void)
+{
+    testCrc();
+    testRoundTrip();
+    testBlockBoundaries();
+    testCorruption();
+    testSequenceGaps();
+    testFirmataPackets();
+
+    if (failures) return 1;
+    printf("test_framing: all passed\n");
+    return 0;
+}
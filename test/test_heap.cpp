@@ -0,0 +1,166 @@
+/*
+test_heap.cpp - Host test that Firmata never touches the heap.
+Runs the Firmata part of MuxFirmata's setup() and then every host request and output path
+that has a reply, with malloc(), calloc() and realloc() counted, and fails on any call.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * The whole sketch can't run here: SendOnlySoftwareSerial is AVR assembly and getFreeRAM()
+ * reads __brkval from avr-libc. On the board, __brkval stays 0 as long as nothing allocates,
+ * and getFreeRAM() then measures from __bss_end. The allocator is glibc's, reached through
+ * its __libc_ entry points, so this test only builds on glibc hosts.
+ */
+
+#include <stdio.h>
+
+#include "Firmata.h"
+#include "MuxFraming.h"
+
+extern "C" {
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+    void __libc_free(void *ptr);
+}
+
+static bool counting = false;
+static unsigned long allocations = 0;
+
+extern "C" {
+    void *malloc(size_t size) { if (counting) allocations++; return __libc_malloc(size); }
+    void *calloc(size_t count, size_t size) { if (counting) allocations++; return __libc_calloc(count, size); }
+    void *realloc(void *ptr, size_t size) { if (counting) allocations++; return __libc_realloc(ptr, size); }
+    void free(void *ptr) { __libc_free(ptr); }
+}
+
+
+// loops the host's bytes in and keeps what Firmata sends
+class TestStream : public Stream {
+
+public:
+    TestStream() : inHead(0), inTail(0), outLength(0) {}
+
+    void feed(const byte *data, size_t length)
+    {
+        while (length--) in[inHead++ % sizeof(in)] = *data++;
+    }
+
+    int available(void) { return inHead - inTail; }
+    int peek(void) { return available() ? in[inTail % sizeof(in)] : -1; }
+    int read(void) { return available() ? in[inTail++ % sizeof(in)] : -1; }
+    size_t write(uint8_t c)
+    {
+        if (outLength < sizeof(out)) out[outLength++] = c;
+        return 1;
+    }
+    using Print::write;
+
+    byte in[256];
+    size_t inHead, inTail;
+    byte out[1024];
+    size_t outLength;
+};
+
+static TestStream host;
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok){
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+extern "C" {
+    static void channelCallback(byte, int) {}
+    static void sysexCallback(byte, byte, byte *) {}
+    static void stringCallback(char *) {}
+    static void resetCallback(void) {}
+    static byte replySource(byte *buffer, byte size)
+    {
+        static byte left = 40;
+        byte count = (left < size) ? left : size;
+
+        memset(buffer, 0x01, count);
+        left -= count;
+        return count;
+    }
+}
+
+// the sysex reply to REPORT_FIRMWARE is in the output, with the name read from flash
+static bool findFirmwareReply(void)
+{
+    static const char name[] = FIRMATA_FIRMWARE_NAME;
+    size_t i, k;
+
+    for (i = 0; i + 4 + 2 * strlen(name) < host.outLength; i++){
+        if (host.out[i] != START_SYSEX || host.out[i + 1] != REPORT_FIRMWARE) continue;
+        if (host.out[i + 2] != FIRMATA_FIRMWARE_MAJOR_VERSION || host.out[i + 3] != FIRMATA_FIRMWARE_MINOR_VERSION) continue;
+        for (k = 0; k < strlen(name); k++){
+            if (host.out[i + 4 + 2 * k] != name[k] || host.out[i + 5 + 2 * k] != 0) break;
+        }
+        if (k == strlen(name) && host.out[i + 4 + 2 * k] == END_SYSEX) return true;
+    }
+    return false;
+}
+
+int main(void)
+{
+    static const byte queries[] = {
+        REPORT_VERSION,
+        START_SYSEX, REPORT_FIRMWARE, END_SYSEX,
+        START_SYSEX, STRING_DATA, 'h', 0, 'i', 0, END_SYSEX,
+        START_SYSEX, 0x10, 1, 2, 3, END_SYSEX,
+        ANALOG_MESSAGE | 2, 0x7F, 0x01,
+        DIGITAL_MESSAGE | 1, 0x55, 0x00,
+        SET_PIN_MODE, 20, OUTPUT,
+        REPORT_ANALOG | 3, 1,
+    };
+    static const byte reset[] = {SYSTEM_RESET};
+    static const byte payload[] = {0x00, 0x11, 0x00, 0x22};
+    byte i;
+
+    counting = true;
+
+    // the Firmata part of setup(), as MuxFirmata does it
+    Firmata.setFirmwareVersion(FIRMATA_FIRMWARE_MAJOR_VERSION, FIRMATA_FIRMWARE_MINOR_VERSION);
+    Firmata.attach(ANALOG_MESSAGE, channelCallback);
+    Firmata.attach(DIGITAL_MESSAGE, channelCallback);
+    Firmata.attach(REPORT_ANALOG, channelCallback);
+    Firmata.attach(REPORT_DIGITAL, channelCallback);
+    Firmata.attach(SET_PIN_MODE, channelCallback);
+    Firmata.attach(SET_DIGITAL_PIN_VALUE, channelCallback);
+    Firmata.attach(START_SYSEX, sysexCallback);
+    Firmata.attach(STRING_DATA, stringCallback);
+    Firmata.attach(SYSTEM_RESET, resetCallback);
+    Firmata.begin(host);
+    check(allocations == 0, "setup allocates");
+
+    // what the main loop does with host requests and telemetry
+    host.feed(queries, sizeof(queries));
+    Firmata.processInputBulk();
+    for (i = 0; i < 16; i++) Firmata.sendAnalog(i, i * 64);
+    for (i = 0; i < 16; i++) Firmata.sendDigital(i, i & 1);
+    Firmata.flushDigital();
+    Firmata.sendString("heap");
+    Firmata.sendReply(replySource);
+    Firmata.flushOutput();
+    Firmata.setFramed(true);
+    Firmata.sendPacket(MUX_FRAME_ANALOG, payload, sizeof(payload));
+    Firmata.setFramed(false);
+    host.feed(reset, sizeof(reset));
+    Firmata.processInputBulk();
+    Firmata.flushOutput();
+
+    counting = false;
+
+    check(allocations == 0, "the main loop allocates");
+    check(findFirmwareReply(), "no REPORT_FIRMWARE reply with the name from flash");
+
+    if (failures) return 1;
+    printf("test_heap: no heap allocations, %lu bytes sent\n", (unsigned long)host.outLength);
+    return 0;
+}
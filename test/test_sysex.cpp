@@ -0,0 +1,208 @@
+/*
+test_sysex.cpp - Host tests for Firmata's sysex stream handlers.
+
+Copyright (C) 2016 Jim French. All rights reserved.
+
+See file LICENSE.txt for further informations on licensing terms.
+
+ * Covers a message longer than MAX_DATA_BYTES handed over in pieces, one with no data at all
+ * that still goes to its handler and not to the sysex callback, and a message cut off by
+ * START_SYSEX or SYSTEM_RESET before its END_SYSEX, which the handler has to hear about as
+ * FIRMATA_STREAM_ABORT once and only once.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Firmata.h"
+
+#define STREAM_COMMAND 0x10
+#define PLAIN_COMMAND 0x11
+
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char *what, int line)
+{
+    if (!ok){
+        printf("FAIL line %d: %s\n", line, what);
+        failures++;
+    }
+}
+
+// swallows what Firmata writes, nothing is read from it
+class NullStream : public Stream {
+
+public:
+    int available(void) { return 0; }
+    int peek(void) { return -1; }
+    int read(void) { return -1; }
+    size_t write(uint8_t) { return 1; }
+    using Print::write;
+};
+
+static NullStream host;
+
+// what the handlers saw
+static byte received[512];
+static size_t receivedLength;
+static int ends, aborts, pieces, plains, resets, streamedToCallback;
+static bool refuse = false;
+
+static void clear(void)
+{
+    receivedLength = 0;
+    ends = aborts = pieces = plains = resets = streamedToCallback = 0;
+}
+
+extern "C" {
+    static byte streamHandler(byte command, byte event, byte argc, byte *argv)
+    {
+        CHECK(command == STREAM_COMMAND);
+        if (event == FIRMATA_STREAM_ABORT){
+            aborts++;
+            receivedLength = 0;
+            return 0;
+        }
+        if (refuse && event == FIRMATA_STREAM_MORE) return 0;
+        memcpy(received + receivedLength, argv, argc);
+        receivedLength += argc;
+        if (event == FIRMATA_STREAM_END) ends++;
+        else pieces++;
+        return argc;
+    }
+
+    static void sysexCallback(byte command, byte, byte *)
+    {
+        if (command == PLAIN_COMMAND) plains++;
+        if (command == STREAM_COMMAND) streamedToCallback++;
+    }
+
+    static void resetCallback(void)
+    {
+        resets++;
+    }
+}
+
+static void feed(const byte *data, size_t length)
+{
+    while (length--) Firmata.parse(*data++);
+}
+
+static void feedByte(byte value)
+{
+    Firmata.parse(value);
+}
+
+
+static void testLongMessage(void)
+{
+    size_t i;
+
+    clear();
+    feedByte(START_SYSEX);
+    feedByte(STREAM_COMMAND);
+    for (i = 0; i < 3 * MAX_DATA_BYTES; i++) feedByte(i & 0x7F);
+    feedByte(END_SYSEX);
+
+    CHECK(ends == 1 && aborts == 0);
+    CHECK(pieces >= 2);
+    CHECK(receivedLength == 3 * MAX_DATA_BYTES);
+    for (i = 0; i < receivedLength; i++){
+        if (received[i] != (i & 0x7F)){
+            CHECK(received[i] == (i & 0x7F));
+            break;
+        }
+    }
+}
+
+static void testEmptyMessage(void)
+{
+    static const byte empty[] = {START_SYSEX, STREAM_COMMAND, END_SYSEX};
+    static const byte one[] = {START_SYSEX, STREAM_COMMAND, 9, END_SYSEX};
+
+    clear();
+    feed(empty, sizeof(empty));
+    CHECK(ends == 1 && receivedLength == 0);
+
+    clear();
+    feed(one, sizeof(one));
+    CHECK(ends == 1 && receivedLength == 1 && received[0] == 9);
+    CHECK(streamedToCallback == 0);
+}
+
+// the host lost the END_SYSEX and starts over
+static void testCutByStart(void)
+{
+    static const byte cut[] = {START_SYSEX, STREAM_COMMAND, 1, 2, 3};
+    static const byte again[] = {START_SYSEX, STREAM_COMMAND, 4, 5, END_SYSEX};
+    static const byte plain[] = {START_SYSEX, STREAM_COMMAND, 6, START_SYSEX, PLAIN_COMMAND, 7, END_SYSEX};
+
+    clear();
+    feed(cut, sizeof(cut));
+    feed(again, sizeof(again));
+    CHECK(aborts == 1 && ends == 1);
+    CHECK(receivedLength == 2 && received[0] == 4 && received[1] == 5);
+
+    clear();
+    feed(plain, sizeof(plain));                             // the new message isn't streamed
+    CHECK(aborts == 1 && ends == 0 && plains == 1);
+}
+
+static void testCutByReset(void)
+{
+    static const byte cut[] = {START_SYSEX, STREAM_COMMAND, 1, 2, 3, SYSTEM_RESET};
+
+    clear();
+    feed(cut, sizeof(cut));
+    CHECK(aborts == 1 && resets == 1);
+    CHECK(!Firmata.isParsingMessage());
+
+    feedByte(END_SYSEX);                                    // a stray end now belongs to nothing
+    CHECK(ends == 0 && aborts == 1);
+}
+
+// a message that overflowed was aborted already, cutting it off doesn't abort it again
+static void testOverflowThenCut(void)
+{
+    size_t i;
+
+    clear();
+    feedByte(START_SYSEX);
+    feedByte(PLAIN_COMMAND);
+    for (i = 0; i < 2 * MAX_DATA_BYTES; i++) feedByte(1);   // no handler, dropped when full
+    feedByte(START_SYSEX);
+    feedByte(PLAIN_COMMAND);
+    feedByte(END_SYSEX);
+    CHECK(plains == 1);
+
+    clear();
+    refuse = true;                                          // the handler takes nothing, the buffer fills
+    feedByte(START_SYSEX);
+    feedByte(STREAM_COMMAND);
+    for (i = 0; i < 2 * MAX_DATA_BYTES; i++) feedByte(1);
+    CHECK(aborts == 1);
+    feedByte(SYSTEM_RESET);
+    CHECK(aborts == 1 && resets == 1);
+    refuse = false;
+}
+
+
+int main(void)
+{
+    Firmata.attach(START_SYSEX, sysexCallback);
+    Firmata.attach(SYSTEM_RESET, resetCallback);
+    Firmata.attachSysexStream(STREAM_COMMAND, streamHandler);
+    Firmata.begin(host);
+
+    testLongMessage();
+    testEmptyMessage();
+    testCutByStart();
+    testCutByReset();
+    testOverflowThenCut();
+
+    if (failures) return 1;
+    printf("test_sysex: all passed\n");
+    return 0;
+}